@@ -0,0 +1,296 @@
+// headless ray tracer benchmark, needs no window or GL context
+// loads every .glb in the assets folder next to the cubes of the ray trace scene and runs a fixed
+// camera path through RayTraceBVH, RayTraceScene, RayTraceSceneAccumulate and RayTraceMapper, the results are printed as JSON
+// usage: raytracer_benchmark [assets_dir] [collapse_width] [quantize_bits]
+#include "util.h"
+#include "raytracer.h"
+#include "json.hpp"
+#include <iostream>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
+#include <thread>
+
+static constexpr uint32_t BENCHMARK_WIDTH = 320;
+static constexpr uint32_t BENCHMARK_HEIGHT = 180;
+static constexpr uint32_t BVH_FRAME_COUNT = 16;
+static constexpr uint32_t SCENE_FRAME_COUNT = 4;
+static constexpr uint32_t SCENE_SAMPLE_COUNT = 4;
+static constexpr uint32_t SCENE_MAX_BOUNCES = 3;
+static constexpr uint32_t ACCUMULATE_SAMPLE_COUNT = 4;
+static constexpr uint32_t ACCUMULATE_MAX_PASSES = 32;
+static constexpr float ACCUMULATE_NOISE_THRESHOLD = 0.1f;
+static constexpr uint32_t MAPPER_SAMPLE_COUNT = 1;
+static constexpr uint32_t MAPPER_MAX_BOUNCES = 2;
+
+using BenchmarkClock = std::chrono::high_resolution_clock;
+static double ElapsedMs(BenchmarkClock::time_point start) {
+    return std::chrono::duration<double, std::milli>(BenchmarkClock::now() - start).count();
+}
+
+// camera position i of count on a circle around center, always looking at it
+static RayCamera GetCameraOnPath(const glm::vec3& center, float radius, float height, uint32_t i, uint32_t count) {
+    const float angle = 2.0f * (float)M_PI * (float)i / (float)count;
+    const glm::vec3 pos = center + glm::vec3(glm::sin(angle) * radius, height, glm::cos(angle) * radius);
+    RayCamera cam;
+    cam.SetFromMatrix(glm::lookAt(pos, center, glm::vec3(0.0f, 1.0f, 0.0f)), glm::radians(60.0f), 0.1f, (float)BENCHMARK_WIDTH / (float)BENCHMARK_HEIGHT);
+    return cam;
+}
+static float GetMeanLuminance(const RayImage& img) {
+    double sum = 0.0;
+    for(uint32_t i = 0; i < img.width * img.height; ++i) {
+        sum += 0.2126f * img.colors[i].r + 0.7152f * img.colors[i].g + 0.0722f * img.colors[i].b;
+    }
+    return (float)(sum / glm::max(img.width * img.height, 1u));
+}
+// stands in for the hdr map the app loads, a blue gradient with a white horizon and a small
+// bright sun so the numbers stay reproducible
+static void CreateSkyTexture(Texture2D& tex, uint32_t width, uint32_t height) {
+    glm::vec4* data = (glm::vec4*)malloc(sizeof(glm::vec4) * width * height);
+    for(uint32_t y = 0; y < height; ++y) {
+        const float t = (float)y / (float)(height - 1);
+        const glm::vec4 col = glm::mix(glm::vec4(0.3f, 0.5f, 0.9f, 1.0f), glm::vec4(1.0f, 1.0f, 1.0f, 1.0f), glm::min(t * 2.0f, 1.0f));
+        for(uint32_t x = 0; x < width; ++x) {
+            data[y * width + x] = col;
+        }
+    }
+    const uint32_t sun_x = width / 3;
+    const uint32_t sun_y = height / 5;
+    for(uint32_t y = sun_y; y < sun_y + 2; ++y) {
+        for(uint32_t x = sun_x; x < sun_x + 2; ++x) {
+            data[y * width + x] = glm::vec4(500.0f, 450.0f, 400.0f, 1.0f);
+        }
+    }
+    tex.data = data;
+    tex.type = Texture2D::DataType::Float;
+    tex.width = width;
+    tex.height = height;
+    tex.num_channels = 4;
+}
+static RayObject CreateRayObject(BoundingVolumeHierarchy* bvh, const glm::mat4& mat, const glm::vec4& specular_col, float emission_strength) {
+    RayObject obj = {};
+    obj.bvh = bvh;
+    obj.mat = mat;
+    obj.inv_model_mat = glm::inverse(mat);
+    obj.material.specular_col = specular_col;
+    obj.material.emission_col = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+    obj.material.emission_strength = emission_strength;
+    obj.material.smoothness = 0.0f;
+    obj.material.specular_probability = 0.0f;
+    return obj;
+}
+
+int main(int argc, char** argv) {
+    SetExecutablePath(argv[0]);
+    const std::string assets_dir = argc > 1 ? std::string(argv[1]) : TranslateRelativePath("../../assets");
+    BVHBuildSettings settings;
+    settings.mode = BVHBuildSettings::SAH_BINNED;
+    settings.collapse_width = argc > 2 ? (uint32_t)std::stoul(argv[2]) : 4;
+    settings.quantize_bits = argc > 3 ? (uint32_t)std::stoul(argv[3]) : 0;
+
+    std::vector<std::filesystem::path> files;
+    std::error_code ec;
+    for(const auto& entry : std::filesystem::directory_iterator(assets_dir, ec)) {
+        if(entry.is_regular_file() && entry.path().extension() == ".glb") {
+            files.push_back(entry.path());
+        }
+    }
+    if(ec) {
+        std::cerr << "failed to open " << assets_dir << ": " << ec.message() << std::endl;
+        return -1;
+    }
+    std::sort(files.begin(), files.end());
+
+    nlohmann::json results;
+    results["simd_width"] = SIMD_NATIVE_WIDTH;
+    results["threads"] = std::thread::hardware_concurrency();
+    results["stats_enabled"] = RAYTRACER_STATS != 0;
+    results["collapse_width"] = settings.collapse_width;
+    results["quantize_bits"] = settings.quantize_bits;
+    results["width"] = BENCHMARK_WIDTH;
+    results["height"] = BENCHMARK_HEIGHT;
+
+    // the cubes of the ray trace scene, with lightmap uvs for RayTraceMapper
+    std::vector<Vertex> small_verts;
+    std::vector<uint32_t> small_inds;
+    std::vector<Vertex> large_verts;
+    std::vector<uint32_t> large_inds;
+    const glm::vec4 cols[6] = {
+        {1.0f, 0.0f, 1.0f, 1.0f},
+        {0.0f, 1.0f, 0.0f, 1.0f},
+        {1.0f, 0.0f, 0.0f, 1.0f},
+        {0.0f, 0.0f, 1.0f, 1.0f},
+        {1.0f, 1.0f, 1.0f, 1.0f},
+        {0.0f, 1.0f, 1.0f, 1.0f},
+    };
+    GenerateCube(small_verts, small_inds, {1.0f, 1.0f, 1.0f}, cols);
+    GenerateCube(large_verts, large_inds, {30.0f, 0.1f, 30.0f}, cols);
+    const ISize small_sz = GenerateUVs(small_verts, small_inds, 64);
+    const ISize large_sz = GenerateUVs(large_verts, large_inds, 128);
+    Mesh small_cube_mesh = CreateMesh(small_verts.data(), small_inds.data(), small_verts.size(), small_inds.size(), false);
+    Mesh large_cube_mesh = CreateMesh(large_verts.data(), large_inds.data(), large_verts.size(), large_inds.size(), false);
+
+    std::vector<GLTFLoadData> models;
+    for(const std::filesystem::path& file : files) {
+        models.push_back(LoadGLTFLoadData(file.string().c_str(), false));
+    }
+
+    // bvhs is sized once before the RayObjects point into it
+    struct BenchmarkMesh {
+        const Mesh* mesh;
+        std::string name;
+    };
+    std::vector<BenchmarkMesh> meshes = {{&small_cube_mesh, "small_cube"}, {&large_cube_mesh, "large_cube"}};
+    for(size_t i = 0; i < models.size(); ++i) {
+        for(size_t j = 0; j < models[i].meshes.size(); ++j) {
+            meshes.push_back({&models[i].meshes[j].mesh, files[i].filename().string() + "/" + std::to_string(j)});
+        }
+    }
+    std::vector<BoundingVolumeHierarchy> bvhs(meshes.size());
+    double total_build_ms = 0.0;
+    for(size_t i = 0; i < meshes.size(); ++i) {
+        const auto start = BenchmarkClock::now();
+        bvhs[i].CreateFromMesh(meshes[i].mesh, settings);
+        const double build_ms = ElapsedMs(start);
+        total_build_ms += build_ms;
+
+        nlohmann::json entry;
+        entry["mesh"] = meshes[i].name;
+        entry["triangles"] = meshes[i].mesh->triangle_count;
+        entry["build_ms"] = build_ms;
+        entry["sah_cost"] = bvhs[i].build_sah_cost;
+        results["build"]["meshes"].push_back(entry);
+    }
+    results["build"]["total_ms"] = total_build_ms;
+
+    // primary rays against every BVH on its own, each model is orbited at twice its size
+    {
+        uint64_t rays = 0;
+        double trace_ms = 0.0;
+        float luminance = 0.0f;
+        for(size_t i = 0; i < bvhs.size(); ++i) {
+            const BoundingBox& bb = meshes[i].mesh->bb;
+            const glm::vec3 center = (bb.min + bb.max) * 0.5f;
+            const float radius = glm::max(glm::length(bb.max - bb.min), 1e-3f);
+            for(uint32_t frame = 0; frame < BVH_FRAME_COUNT; ++frame) {
+                const RayCamera cam = GetCameraOnPath(center, radius, radius * 0.25f, frame, BVH_FRAME_COUNT);
+                const auto start = BenchmarkClock::now();
+                RayImage img = RayTraceBVH(cam, bvhs[i], glm::identity<glm::mat4>(), BENCHMARK_WIDTH, BENCHMARK_HEIGHT);
+                trace_ms += ElapsedMs(start);
+                rays += BENCHMARK_WIDTH * BENCHMARK_HEIGHT;
+                luminance += GetMeanLuminance(img);
+            }
+        }
+        results["bvh"]["frames"] = BVH_FRAME_COUNT * bvhs.size();
+        results["bvh"]["rays"] = rays;
+        results["bvh"]["trace_ms"] = trace_ms;
+        results["bvh"]["mrays_per_s"] = (double)rays / (trace_ms * 1000.0);
+        results["bvh"]["mean_luminance"] = luminance / (float)(BVH_FRAME_COUNT * bvhs.size());
+    }
+
+    // the ray trace scene with the models lined up behind the small cube
+    Texture2D sky;
+    CreateSkyTexture(sky, 64, 32);
+    RayScene scene;
+    EnvironmentMapSampler sky_sampler;
+    sky_sampler.Build(&sky);
+    scene.hdr_map = &sky;
+    scene.hdr_sampler = &sky_sampler;
+    scene.objects.push_back(CreateRayObject(&bvhs[0], glm::translate(glm::identity<glm::mat4>(), glm::vec3(0.0f, 0.5f, -3.0f)), glm::vec4(1.0f), 0.0f));
+    scene.objects.push_back(CreateRayObject(&bvhs[0], glm::translate(glm::identity<glm::mat4>(), glm::vec3(0.0f, 0.5f, 10.0f)), glm::vec4(1.0f), 10.0f));
+    scene.objects.push_back(CreateRayObject(&bvhs[1], glm::translate(glm::identity<glm::mat4>(), glm::vec3(0.0f, -0.05f, 0.0f)), glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), 0.0f));
+    std::vector<LitObject> lit_objects;
+    lit_objects.push_back({RayImage(small_sz.width, small_sz.height), 0});
+    lit_objects.push_back({RayImage(large_sz.width, large_sz.height), 2});
+    for(size_t i = 2; i < bvhs.size(); ++i) {
+        // scaled to 1.5 units, standing on the floor
+        const BoundingBox& bb = meshes[i].mesh->bb;
+        const float scale = 1.5f / glm::max(glm::max(bb.max.x - bb.min.x, bb.max.y - bb.min.y), glm::max(bb.max.z - bb.min.z, 1e-6f));
+        const glm::vec3 pos = glm::vec3(((float)(i - 2) - (float)(bvhs.size() - 3) * 0.5f) * 2.0f, 0.0f, -6.0f);
+        glm::mat4 mat = glm::translate(glm::identity<glm::mat4>(), pos);
+        mat = glm::scale(mat, glm::vec3(scale));
+        mat = glm::translate(mat, -glm::vec3((bb.min.x + bb.max.x) * 0.5f, bb.min.y, (bb.min.z + bb.max.z) * 0.5f));
+        scene.objects.push_back(CreateRayObject(&bvhs[i], mat, glm::vec4(0.8f, 0.8f, 0.8f, 1.0f), 0.0f));
+    }
+    scene.BuildTopLevel();
+
+    {
+        uint64_t samples = 0;
+        double trace_ms = 0.0;
+        float luminance = 0.0f;
+        RayTraceStats total;
+        for(uint32_t frame = 0; frame < SCENE_FRAME_COUNT; ++frame) {
+            const RayCamera cam = GetCameraOnPath(glm::vec3(0.0f, 0.5f, -4.0f), 7.0f, 2.0f, frame, SCENE_FRAME_COUNT);
+            RayTraceFrameStats stats;
+            RayImage img = RayTraceScene(cam, scene, SCENE_MAX_BOUNCES, SCENE_SAMPLE_COUNT, BENCHMARK_WIDTH, BENCHMARK_HEIGHT, &stats);
+            trace_ms += stats.trace_ms;
+            total += stats.total;
+            samples += BENCHMARK_WIDTH * BENCHMARK_HEIGHT * SCENE_SAMPLE_COUNT;
+            luminance += GetMeanLuminance(img);
+        }
+        results["scene"]["frames"] = SCENE_FRAME_COUNT;
+        results["scene"]["sample_count"] = SCENE_SAMPLE_COUNT;
+        results["scene"]["max_bounces"] = SCENE_MAX_BOUNCES;
+        results["scene"]["samples"] = samples;
+        results["scene"]["trace_ms"] = trace_ms;
+        results["scene"]["msamples_per_s"] = (double)samples / (trace_ms * 1000.0);
+        // only known when the rays were counted, every bounce and occlusion query is a ray
+        if(RAYTRACER_STATS) {
+            results["scene"]["rays"] = total.rays;
+            results["scene"]["mrays_per_s"] = (double)total.rays / (trace_ms * 1000.0);
+        }
+        results["scene"]["mean_luminance"] = luminance / (float)SCENE_FRAME_COUNT;
+    }
+
+    {
+        // adaptive accumulation of one view until it converges, samples counts what the pixels actually got
+        const RayCamera cam = GetCameraOnPath(glm::vec3(0.0f, 0.5f, -4.0f), 7.0f, 2.0f, 0, SCENE_FRAME_COUNT);
+        RayImage img(BENCHMARK_WIDTH, BENCHMARK_HEIGHT);
+        uint32_t passes = 0;
+        bool converged = false;
+        double trace_ms = 0.0;
+        while(!converged && passes < ACCUMULATE_MAX_PASSES) {
+            RayTraceFrameStats stats;
+            converged = RayTraceSceneAccumulate(img, cam, scene, SCENE_MAX_BOUNCES, ACCUMULATE_SAMPLE_COUNT, &stats, ACCUMULATE_NOISE_THRESHOLD);
+            trace_ms += stats.trace_ms;
+            passes++;
+        }
+        uint64_t samples = 0;
+        for(const RayPixelEstimate& estimate : img.estimates) {
+            samples += estimate.sample_count;
+        }
+        results["accumulate"]["noise_threshold"] = ACCUMULATE_NOISE_THRESHOLD;
+        results["accumulate"]["sample_count"] = ACCUMULATE_SAMPLE_COUNT;
+        results["accumulate"]["passes"] = passes;
+        results["accumulate"]["converged"] = converged;
+        results["accumulate"]["samples"] = samples;
+        results["accumulate"]["uniform_samples"] = (uint64_t)BENCHMARK_WIDTH * BENCHMARK_HEIGHT * ACCUMULATE_SAMPLE_COUNT * passes;
+        results["accumulate"]["trace_ms"] = trace_ms;
+        results["accumulate"]["mean_luminance"] = GetMeanLuminance(img);
+    }
+
+    {
+        uint64_t texels = 0;
+        const auto start = BenchmarkClock::now();
+        for(LitObject& lit : lit_objects) {
+            RayTraceMapper(lit, scene, MAPPER_MAX_BOUNCES, MAPPER_SAMPLE_COUNT);
+            texels += lit.lightmap.width * lit.lightmap.height;
+        }
+        const double trace_ms = ElapsedMs(start);
+        results["mapper"]["sample_count"] = MAPPER_SAMPLE_COUNT;
+        results["mapper"]["max_bounces"] = MAPPER_MAX_BOUNCES;
+        results["mapper"]["texels"] = texels;
+        results["mapper"]["trace_ms"] = trace_ms;
+        results["mapper"]["ktexels_per_s"] = (double)texels / trace_ms;
+    }
+
+    results["peak_memory_bytes"] = GetPeakMemoryUsage();
+    std::cout << results.dump(2) << std::endl;
+
+    for(GLTFLoadData& model : models) {
+        DestroyGLTFLoadData(&model);
+    }
+    DestroyMesh(&small_cube_mesh);
+    DestroyMesh(&large_cube_mesh);
+    return 0;
+}
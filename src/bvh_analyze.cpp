@@ -0,0 +1,73 @@
+// headless BVH quality report for every .glb in the assets folder, needs no window or GL context
+// usage: bvh_analyze [assets_dir] [collapse_width] [quantize_bits]
+#include "util.h"
+#include "raytracer.h"
+#include "json.hpp"
+#include <iostream>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
+
+static const char* GetModeName(BVHBuildSettings::Mode mode) {
+    switch(mode) {
+    case BVHBuildSettings::MIDPOINT_SPLIT: return "midpoint_split";
+    case BVHBuildSettings::SAH_BINNED: return "sah_binned";
+    case BVHBuildSettings::LINEAR_MORTON: return "linear_morton";
+    case BVHBuildSettings::SAH_SPATIAL: return "sah_spatial";
+    }
+    return "unknown";
+}
+
+int main(int argc, char** argv) {
+    SetExecutablePath(argv[0]);
+    const std::string assets_dir = argc > 1 ? std::string(argv[1]) : TranslateRelativePath("../../assets");
+    const uint32_t collapse_width = argc > 2 ? (uint32_t)std::stoul(argv[2]) : 2;
+    const uint32_t quantize_bits = argc > 3 ? (uint32_t)std::stoul(argv[3]) : 0;
+
+    std::vector<std::filesystem::path> files;
+    std::error_code ec;
+    for(const auto& entry : std::filesystem::directory_iterator(assets_dir, ec)) {
+        if(entry.is_regular_file() && entry.path().extension() == ".glb") {
+            files.push_back(entry.path());
+        }
+    }
+    if(ec) {
+        std::cerr << "failed to open " << assets_dir << ": " << ec.message() << std::endl;
+        return -1;
+    }
+    std::sort(files.begin(), files.end());
+
+    const BVHBuildSettings::Mode modes[] = {BVHBuildSettings::MIDPOINT_SPLIT, BVHBuildSettings::SAH_BINNED, BVHBuildSettings::LINEAR_MORTON, BVHBuildSettings::SAH_SPATIAL};
+    nlohmann::json results = nlohmann::json::array();
+    for(const std::filesystem::path& file : files) {
+        GLTFLoadData data = LoadGLTFLoadData(file.string().c_str(), false);
+        for(uint32_t mesh_idx = 0; mesh_idx < data.meshes.size(); ++mesh_idx) {
+            const Mesh& mesh = data.meshes[mesh_idx].mesh;
+            for(BVHBuildSettings::Mode mode : modes) {
+                BVHBuildSettings settings;
+                settings.mode = mode;
+                settings.collapse_width = collapse_width;
+                settings.quantize_bits = quantize_bits;
+
+                BoundingVolumeHierarchy bvh;
+                const auto start = std::chrono::high_resolution_clock::now();
+                bvh.CreateFromMesh(&mesh, settings);
+                const auto end = std::chrono::high_resolution_clock::now();
+
+                nlohmann::json entry;
+                entry["file"] = file.filename().string();
+                entry["mesh"] = mesh_idx;
+                entry["triangles"] = mesh.triangle_count;
+                entry["mode"] = GetModeName(mode);
+                entry["collapse_width"] = bvh.settings.collapse_width;
+                entry["quantize_bits"] = bvh.settings.quantize_bits;
+                entry["build_ms"] = std::chrono::duration<double, std::milli>(end - start).count();
+                entry["report"] = nlohmann::json::parse(bvh.Analyze().ToJson());
+                results.push_back(entry);
+            }
+        }
+        DestroyGLTFLoadData(&data);
+    }
+    std::cout << results.dump(2) << std::endl;
+    return 0;
+}
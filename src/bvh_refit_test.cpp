@@ -0,0 +1,70 @@
+// headless check that BoundingVolumeHierarchy::Refit reports a cost ratio of 1 for geometry that didn't move
+// usage: bvh_refit_test, returns non zero if any build mode fails
+#include "util.h"
+#include "raytracer.h"
+#include <iostream>
+#include <cmath>
+
+// long thin triangles in random directions, spatial splits clip almost every one of them
+static void GenerateTriangleSoup(std::vector<Vertex>& verts, std::vector<uint32_t>& inds, uint32_t triangle_count) {
+    uint32_t state = 12345u;
+    auto next = [&state]() {
+        state = state * 1664525u + 1013904223u;
+        return (float)(state >> 8) / (float)(1u << 24);
+    };
+    for(uint32_t i = 0; i < triangle_count; ++i) {
+        const glm::vec3 center = glm::vec3(next(), next(), next()) * 10.0f;
+        const glm::vec3 dir = glm::normalize(glm::vec3(next(), next(), next()) - 0.5f) * (1.0f + 4.0f * next());
+        const glm::vec3 offset = glm::vec3(next(), next(), next()) * 0.05f;
+        const glm::vec3 positions[3] = {center - dir, center + dir, center + offset};
+        for(const glm::vec3& pos : positions) {
+            Vertex vert = {};
+            vert.pos = pos;
+            inds.push_back(verts.size());
+            verts.push_back(vert);
+        }
+    }
+}
+
+int main() {
+    std::vector<Vertex> verts;
+    std::vector<uint32_t> inds;
+    GenerateTriangleSoup(verts, inds, 2000);
+    Mesh mesh = CreateMesh(verts.data(), inds.data(), verts.size(), inds.size(), false);
+    // same vertices but one triangle less, Refit has to rebuild instead of reusing the tree
+    Mesh smaller_mesh = CreateMesh(verts.data(), inds.data(), verts.size(), inds.size() - 3, false);
+
+    const BVHBuildSettings::Mode modes[] = {BVHBuildSettings::MIDPOINT_SPLIT, BVHBuildSettings::SAH_BINNED, BVHBuildSettings::LINEAR_MORTON, BVHBuildSettings::SAH_SPATIAL};
+    const uint32_t widths[] = {2, 4, 8};
+    int failed = 0;
+    for(BVHBuildSettings::Mode mode : modes) {
+        for(uint32_t width : widths) {
+            BVHBuildSettings settings;
+            settings.mode = mode;
+            settings.collapse_width = width;
+            BoundingVolumeHierarchy bvh;
+            bvh.CreateFromMesh(&mesh, settings);
+            if(mode == BVHBuildSettings::SAH_SPATIAL && bvh.GetTriangleCount() <= mesh.triangle_count) {
+                std::cerr << "mode " << mode << ": no spatial splits, the test mesh doesn't cover them" << std::endl;
+                failed = 1;
+            }
+
+            const float ratio = bvh.Refit(&mesh);
+            if(std::abs(ratio - 1.0f) > 1e-3f) {
+                std::cerr << "mode " << mode << " width " << width << ": refit of unchanged geometry returned " << ratio << std::endl;
+                failed = 1;
+            }
+            bvh.Refit(&smaller_mesh);
+            if(bvh.mesh_triangle_count != smaller_mesh.triangle_count) {
+                std::cerr << "mode " << mode << " width " << width << ": refit kept the tree of a mesh with another triangle count" << std::endl;
+                failed = 1;
+            }
+        }
+    }
+    DestroyMesh(&mesh);
+    DestroyMesh(&smaller_mesh);
+    if(!failed) {
+        std::cout << "refit ok" << std::endl;
+    }
+    return failed;
+}
@@ -1,6 +1,7 @@
 #include "helper_math.h"
 #include <glm/ext/scalar_constants.hpp>
 #include <random>
+#include <array>
 #include <corecrt_math_defines.h>
 
 static float sign(const glm::vec2& p1, const glm::vec2& p2, const glm::vec2& p3) {
@@ -55,30 +56,168 @@ uint32_t ConvertColor(const glm::vec4& col) {
     const uint32_t out_col = ((uint32_t)(255 * clipped.a) << 24) | ((uint32_t)(255 * clipped.b) << 16) | ((uint32_t)(255 * clipped.g) << 8) | ((uint32_t)(255 * clipped.r));
     return out_col;
 }
+RandomState& GetThreadRandomState() {
+    thread_local RandomState rng = []() {
+        std::random_device device;
+        const uint64_t seed = ((uint64_t)device() << 32) | device();
+        return RandomState(seed, device());
+    }();
+    return rng;
+}
+
+static uint32_t ReverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+// hash where every bit only depends on the bits below it (Laine and Karras, constants from Burley)
+static uint32_t LaineKarrasPermutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6C50B47Cu;
+    x ^= x * 0xB82F1E52u;
+    x ^= x * 0xC7AFE638u;
+    x ^= x * 0x8D22F6E6u;
+    return x;
+}
+// owen scrambling, every bit gets flipped depending on the bits above it
+static uint32_t NestedUniformScramble(uint32_t x, uint32_t seed) {
+    return ReverseBits(LaineKarrasPermutation(ReverseBits(x), seed));
+}
+// second sobol dimension (direction numbers of the polynomial x + 1) with its bits reversed, so it can go right into the scramble
+// scrambled indices use all 32 bits, so the direction numbers are xor-ed together a byte at a time from a table
+static const std::array<std::array<uint32_t, 256>, 4> SOBOL_SECOND_DIMENSION = []() {
+    std::array<uint32_t, 32> directions;
+    uint32_t v = 1;
+    for(uint32_t bit = 0; bit < 32; ++bit, v ^= v << 1) {
+        directions[bit] = v;
+    }
+    std::array<std::array<uint32_t, 256>, 4> table;
+    for(uint32_t byte = 0; byte < 4; ++byte) {
+        for(uint32_t value = 0; value < 256; ++value) {
+            uint32_t result = 0;
+            for(uint32_t bit = 0; bit < 8; ++bit) {
+                if(value & (1u << bit)) {
+                    result ^= directions[byte * 8 + bit];
+                }
+            }
+            table[byte][value] = result;
+        }
+    }
+    return table;
+}();
+static uint32_t SobolSecondDimensionReversed(uint32_t index) {
+    return SOBOL_SECOND_DIMENSION[0][index & 0xFF] ^ SOBOL_SECOND_DIMENSION[1][(index >> 8) & 0xFF] ^ SOBOL_SECOND_DIMENSION[2][(index >> 16) & 0xFF] ^ SOBOL_SECOND_DIMENSION[3][index >> 24];
+}
+static float SequenceToFloat(uint32_t x) {
+    return (float)(x >> 8) * (1.0f / 16777216.0f);
+}
+// splitmix64 finalizer
+static uint64_t MixBits(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+// shuffling the index keeps aligned blocks of 2^k points together, so every pair still starts with a well stratified set
+// the first sobol dimension is the van der corput sequence, the bit reversal cancels out with the one of the scramble
+glm::vec2 SampleSequence::Next2D() {
+    const uint64_t dim_seed = MixBits(this->seed + 0x9E3779B97F4A7C15ull * this->dimension++);
+    const uint64_t y_seed = MixBits(dim_seed);
+    const uint32_t index = NestedUniformScramble(this->sample_idx, (uint32_t)dim_seed);
+    const uint32_t x = ReverseBits(LaineKarrasPermutation(index, (uint32_t)(dim_seed >> 32)));
+    const uint32_t y = ReverseBits(LaineKarrasPermutation(SobolSecondDimensionReversed(index), (uint32_t)y_seed));
+    return glm::vec2(SequenceToFloat(x), SequenceToFloat(y));
+}
+float SampleSequence::Next1D() {
+    const uint64_t dim_seed = MixBits(this->seed + 0x9E3779B97F4A7C15ull * this->dimension++);
+    const uint32_t index = NestedUniformScramble(this->sample_idx, (uint32_t)dim_seed);
+    return SequenceToFloat(ReverseBits(LaineKarrasPermutation(index, (uint32_t)(dim_seed >> 32))));
+}
+
+float GetRandomFloat(RandomState& rng, float start, float end) {
+    return start + (end - start) * rng.NextFloat();
+}
+uint32_t GetRandomUint32(RandomState& rng, uint32_t start, uint32_t end) {
+    const uint64_t range = (uint64_t)end - (uint64_t)start + 1;
+    return start + (uint32_t)(((uint64_t)rng.NextUint32() * range) >> 32);
+}
+glm::vec3 GetRandomNormalizedVector(RandomState& rng) {
+    // uniform height on the sphere gives uniform area (archimedes), normalizing a point in a cube would favor the corners
+    const float z = GetRandomFloat(rng, -1.0f, 1.0f);
+    const float angle = GetRandomFloat(rng, 0.0f, 2.0f * M_PI);
+    const float r = sqrtf(glm::max(1.0f - z * z, 0.0f));
+    return glm::vec3(r * cosf(angle), r * sinf(angle), z);
+}
+glm::vec2 GetRandomPointInSquare(RandomState& rng) {
+    return glm::vec2(GetRandomFloat(rng, -0.5f, 0.5f), GetRandomFloat(rng, -0.5f, 0.5f));
+}
+glm::vec2 GetRandomPointInCircle(RandomState& rng) {
+    const float angle = GetRandomFloat(rng, 0.0f, 2.0f * M_PI);
+    return glm::vec2(cosf(angle), sinf(angle)) * sqrtf(GetRandomFloat(rng, 0.0f, 1.0f));
+}
+glm::vec3 GetRandomCosineDirection(RandomState& rng) {
+    const float u = rng.NextFloat();
+    return SquareToCosineDirection(glm::vec2(u, rng.NextFloat()));
+}
+glm::vec3 GetRandomGGXNormal(RandomState& rng, float alpha) {
+    const float u = rng.NextFloat();
+    return SquareToGGXNormal(glm::vec2(u, rng.NextFloat()), alpha);
+}
+
+glm::vec2 SquareToDisk(const glm::vec2& u) {
+    const glm::vec2 p = u * 2.0f - 1.0f;
+    if(p.x == 0.0f && p.y == 0.0f) {
+        return glm::vec2(0.0f);
+    }
+    // squares map to circles, so points that were close stay close
+    float r;
+    float angle;
+    if(fabsf(p.x) > fabsf(p.y)) {
+        r = p.x;
+        angle = (float)M_PI_4 * (p.y / p.x);
+    }
+    else {
+        r = p.y;
+        angle = (float)M_PI_2 - (float)M_PI_4 * (p.x / p.y);
+    }
+    return glm::vec2(r * cosf(angle), r * sinf(angle));
+}
+glm::vec3 SquareToCosineDirection(const glm::vec2& u) {
+    // uniform point on the disk projected up onto the hemisphere
+    const glm::vec2 p = SquareToDisk(u);
+    return glm::vec3(p.x, p.y, sqrtf(glm::max(1.0f - p.x * p.x - p.y * p.y, 0.0f)));
+}
+glm::vec3 SquareToGGXNormal(const glm::vec2& u, float alpha) {
+    const float angle = 2.0f * (float)M_PI * u.y;
+    const float tan2_theta = alpha * alpha * u.x / (1.0f - u.x);
+    const float cos_theta = 1.0f / sqrtf(1.0f + tan2_theta);
+    const float sin_theta = sqrtf(glm::max(1.0f - cos_theta * cos_theta, 0.0f));
+    return glm::vec3(sin_theta * cosf(angle), sin_theta * sinf(angle), cos_theta);
+}
+
+void BuildOrthonormalBasis(const glm::vec3& n, glm::vec3& tangent, glm::vec3& bitangent) {
+    // branchless version from Duff et al. 2017, stable for every n
+    const float sign = copysignf(1.0f, n.z);
+    const float a = -1.0f / (sign + n.z);
+    const float b = n.x * n.y * a;
+    tangent = glm::vec3(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    bitangent = glm::vec3(b, sign + n.y * n.y * a, -n.y);
+}
+
 float GetRandomFloat(float start, float end) {
-    static std::random_device device;
-    static std::mt19937 ran(device());
-    std::uniform_real_distribution<float> dist(start, end);
-    return dist(ran);
+    return GetRandomFloat(GetThreadRandomState(), start, end);
 }
 uint32_t GetRandomUint32(uint32_t start, uint32_t end) {
-    static std::random_device device;
-    static std::mt19937 ran(device());
-    std::uniform_int_distribution<uint32_t> dist(start, end);
-    return dist(ran);
+    return GetRandomUint32(GetThreadRandomState(), start, end);
 }
 glm::vec3 GetRandomNormalizedVector() {
-    static std::random_device device;
-    static std::mt19937 ran(device());
-    static std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
-    glm::vec3 dir = glm::vec3(dist(ran), dist(ran), dist(ran));
-    return glm::normalize(dir);
+    return GetRandomNormalizedVector(GetThreadRandomState());
 }
 
 glm::vec2 GetRandomPointInSquare() {
-    return glm::vec2(GetRandomFloat(-0.5f, 0.5f), GetRandomFloat(-0.5f, 0.5f));
+    return GetRandomPointInSquare(GetThreadRandomState());
 }
 glm::vec2 GetRandomPointInCircle() {
-    const float angle = GetRandomFloat(0.0f, 2.0f * M_PI);
-    return glm::vec2(cosf(angle), sinf(angle)) * sqrtf(GetRandomFloat(0.0f, 1.0f));
+    return GetRandomPointInCircle(GetThreadRandomState());
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <stdint.h>
 
 
 bool IsPointInTriangle(const glm::vec2& pt, const glm::vec2& t1, const glm::vec2& t2, const glm::vec2& t3);
@@ -14,6 +15,91 @@ float AngleBetweenVectors(const glm::vec3& v1, const glm::vec3& v2, const glm::v
 
 uint32_t ConvertColor(const glm::vec4& col);
 
+// mixes up to three integers into one seed, used to derive reproducible
+// random streams from e.g. (pixel, sample, bounce)
+inline uint64_t RandomSeed(uint64_t a, uint64_t b = 0, uint64_t c = 0) {
+    // splitmix64 finalizer applied after folding in every value
+    uint64_t h = 0x9E3779B97F4A7C15ull;
+    const uint64_t vals[3] = {a, b, c};
+    for(uint64_t v : vals) {
+        h ^= v + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+        h = h ^ (h >> 31);
+    }
+    return h;
+}
+
+// PCG32, small enough to create one per pixel sample without any cost
+struct RandomState {
+    RandomState(uint64_t seed = 0, uint64_t stream = 0) {
+        this->state = 0;
+        this->inc = (stream << 1u) | 1u;
+        this->NextUint32();
+        this->state += seed;
+        this->NextUint32();
+    }
+    uint32_t NextUint32() {
+        const uint64_t old = this->state;
+        this->state = old * 6364136223846793005ull + this->inc;
+        const uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+        const uint32_t rot = (uint32_t)(old >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+    }
+    // [0, 1)
+    float NextFloat() {
+        return (float)(this->NextUint32() >> 8) * (1.0f / 16777216.0f);
+    }
+    uint64_t state;
+    uint64_t inc;
+};
+// per thread generator seeded from std::random_device, used by the overloads without a state
+RandomState& GetThreadRandomState();
+
+// owen scrambled sobol points (Burley 2020, practical hash-based owen scrambling)
+// a sequence (e.g. one pixel) is picked by seed, sample_idx selects the point along it
+// every pair of dimensions is its own shuffled and scrambled 2d sobol sequence, so the first
+// 2^k samples of any pair are stratified while different pairs stay uncorrelated
+struct SampleSequence {
+    SampleSequence(uint64_t seed = 0, uint32_t sample_idx = 0, uint32_t dimension = 0) {
+        this->seed = seed;
+        this->sample_idx = sample_idx;
+        this->dimension = dimension;
+    }
+    // next pair of dimensions, [0, 1)
+    glm::vec2 Next2D();
+    // first half of the next pair, the second half is skipped
+    float Next1D();
+    uint64_t seed;
+    uint32_t sample_idx;
+    // next unused pair
+    uint32_t dimension;
+};
+
+// [start, end]
+float GetRandomFloat(RandomState& rng, float start, float end);
+// [start, end]
+uint32_t GetRandomUint32(RandomState& rng, uint32_t start, uint32_t end);
+// uniformly distributed over the unit sphere
+glm::vec3 GetRandomNormalizedVector(RandomState& rng);
+glm::vec2 GetRandomPointInSquare(RandomState& rng);
+glm::vec2 GetRandomPointInCircle(RandomState& rng);
+// hemisphere around +z, pdf = cos(theta) / pi
+glm::vec3 GetRandomCosineDirection(RandomState& rng);
+// microfacet normal of the GGX distribution with roughness alpha around +z, pdf = D(h) * cos(theta_h)
+glm::vec3 GetRandomGGXNormal(RandomState& rng, float alpha);
+
+// map uniform points in [0, 1)^2 (e.g. from SampleSequence) to the distributions above without breaking up their stratification
+// unit disk, concentric mapping (Shirley and Chiu)
+glm::vec2 SquareToDisk(const glm::vec2& u);
+// hemisphere around +z, pdf = cos(theta) / pi
+glm::vec3 SquareToCosineDirection(const glm::vec2& u);
+// like GetRandomGGXNormal
+glm::vec3 SquareToGGXNormal(const glm::vec2& u, float alpha);
+
+// tangent and bitangent so that (tangent, bitangent, n) is a right handed orthonormal basis, n has to be normalized
+void BuildOrthonormalBasis(const glm::vec3& n, glm::vec3& tangent, glm::vec3& bitangent);
+
 // [start, end]
 float GetRandomFloat(float start, float end);
 // [start, end]
@@ -1,5 +1,6 @@
 #include <iostream>
 #include "util.h"
+#include "GLFW/glfw3.h"
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
@@ -18,6 +19,7 @@ static constexpr float FAR_PLANE = 100.0f;
 static constexpr float FOV = glm::radians(45.0f);
 
 static Texture2D hdr_map;
+static EnvironmentMapSampler hdr_sampler;
 static Texture2D white_texture;
 struct Scene {
     virtual void Draw(const glm::mat4& proj_mat, const glm::mat4& view_mat, const BasicShader& basic_shader, uint32_t width, uint32_t height) = 0;
@@ -50,8 +52,12 @@ struct RaytraceCubeScene : public Scene {
 
         this->small_cube_mesh = CreateMesh(small_verts.data(), small_inds.data(), small_verts.size(), small_inds.size());
         this->large_cube_mesh = CreateMesh(large_verts.data(), large_inds.data(), large_verts.size(), large_inds.size());
-        small_cube_bvh.CreateFromMesh(&small_cube_mesh, 8);
-        large_cube_bvh.CreateFromMesh(&large_cube_mesh, 8);
+        BVHBuildSettings bvh_settings;
+        bvh_settings.mode = BVHBuildSettings::SAH_BINNED;
+        bvh_settings.collapse_width = 4;
+        const std::string bvh_cache_dir = TranslateRelativePath("../../assets/bvh_cache");
+        small_cube_bvh.CreateFromMeshCached(&small_cube_mesh, bvh_settings, bvh_cache_dir.c_str());
+        large_cube_bvh.CreateFromMeshCached(&large_cube_mesh, bvh_settings, bvh_cache_dir.c_str());
         RayObject obj = {};
         obj.bvh = &this->small_cube_bvh;
         this->image = RayImage(this->width, this->height);
@@ -92,7 +98,9 @@ struct RaytraceCubeScene : public Scene {
         this->ray_scene.objects.emplace_back(std::move(obj));
         this->lit_objects.push_back({RayImage(large_sz.width, large_sz.height), 2});
 
+        this->ray_scene.BuildTopLevel();
         this->ray_scene.hdr_map = &hdr_map;
+        this->ray_scene.hdr_sampler = &hdr_sampler;
 
         std::vector<std::future<void>> futures;
         for(size_t i = 0; i < this->lit_objects.size(); ++i) {
@@ -1475,18 +1483,11 @@ int main(int argc, char** argv) {
         int x,y,c;
         float* hdr_data = stbi_loadf(TranslateRelativePath("../../assets/garden.hdr").c_str(), &x, &y, &c, 4);
         if(hdr_data) {
-            // The sun is just WAAAY to bright in the hdr image,
-            // and only a few rays hit it, but the ones that do get a absurdly high value assigned
-            // and stay that way so it doesn't really converge nicely
-            // (well it would if i took millions of samples, but that takes to long)
-            for(size_t i = 0; i < x * y * c; ++i) {
-                if(hdr_data[i] > 1.0f) {
-                    hdr_data[i] = 1.0f;
-                }
-            }
+            // the sun stays at full intensity, the ray tracer samples it directly through hdr_sampler
             hdr_map = CreateTexture2D((const glm::vec4*)hdr_data, x, y);
             stbi_image_free(hdr_data);
         }
+        hdr_sampler.Build(&hdr_map);
     }
 
     if(active_scene == CurrentActiveScene::CS_IntersectionCubeScene) {
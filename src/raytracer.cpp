@@ -1,9 +1,23 @@
 #include "raytracer.h"
 #include "helper_math.h"
+#include "thread_pool.h"
+#include "json.hpp"
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <atomic>
+#include <array>
 
 struct RayHitResult {
     const RayMaterial* material;
+    // only set for hits in a RayScene
+    const RayObject* object;
+    uint32_t triangle_idx;
     glm::vec3 pos;
     glm::vec3 normal;
     glm::vec4 col;
@@ -24,11 +38,30 @@ static bool PosInBoundingBox(const BoundingBox& bb, const glm::vec3& pos) {
     return false;
 }
 
-static RayHitResult RayTriangleIntersection(const Ray& ray, const Vertex& v1, const Vertex& v2, const Vertex& v3) {
-    const glm::vec3 v21 = v2.pos - v1.pos;
-    const glm::vec3 v31 = v3.pos - v1.pos;
+// what the intersection kernels report, the surface attributes are only
+// resolved once for the final closest hit (see ResolveHit)
+struct RayTriangleHit {
+    static constexpr uint32_t INVALID_TRIANGLE = 0xFFFFFFFFu;
+    float length;
+    // barycentric weights of the second and third corner
+    float u;
+    float v;
+    uint32_t trig_idx;
+    bool Hit() const { return this->trig_idx != INVALID_TRIANGLE; }
+};
+static RayTriangleHit EmptyTriangleHit(float max_dist) {
+    RayTriangleHit hit;
+    hit.length = max_dist;
+    hit.u = 0.0f;
+    hit.v = 0.0f;
+    hit.trig_idx = RayTriangleHit::INVALID_TRIANGLE;
+    return hit;
+}
+
+// only reports hits closer than max_dist
+static bool RayTriangleIntersection(const Ray& ray, const glm::vec3& v1, const glm::vec3& v21, const glm::vec3& v31, float max_dist, float& out_dst, float& out_u, float& out_v) {
     const glm::vec3 normal = glm::cross(v21, v31);
-    const glm::vec3 ao = ray.origin - v1.pos;
+    const glm::vec3 ao = ray.origin - v1;
     const glm::vec3 dao = glm::cross(ao, ray.dir);
 
     const float determinant = -glm::dot(ray.dir, normal);
@@ -39,19 +72,34 @@ static RayHitResult RayTriangleIntersection(const Ray& ray, const Vertex& v1, co
     const float v = -glm::dot(v21, dao) * inv_det;
     const float w = 1.0f - u - v;
 
-
+    out_dst = dst;
+    out_u = u;
+    out_v = v;
+    return determinant >= 1e-8 && dst >= 0.0f && dst < max_dist && u >= 0.0f && v >= 0.0f && w >= 0.0f;
+}
+static RayHitResult ResolveHit(const Ray& ray, const Vertex& v1, const Vertex& v2, const Vertex& v3, const RayTriangleHit& hit) {
+    const float w = 1.0f - hit.u - hit.v;
     RayHitResult hit_result = {};
-    hit_result.hit = determinant >= 1e-8 && dst >= 0.0f && u >= 0.0f && v >= 0.0f && w >= 0.0f;
-    hit_result.pos = ray.origin + ray.dir * dst;
-    hit_result.normal = glm::normalize(v1.nor * w + v2.nor * u + v3.nor * v);
-    hit_result.col = (v1.col * w + v2.col * u + v3.col * v);
-    hit_result.uv = (v1.uv * w + v2.uv * u + v3.uv * v);
-    hit_result.length = dst;
-
+    hit_result.hit = true;
+    hit_result.length = hit.length;
+    hit_result.pos = ray.origin + ray.dir * hit.length;
+    hit_result.normal = glm::normalize(v1.nor * w + v2.nor * hit.u + v3.nor * hit.v);
+    hit_result.col = (v1.col * w + v2.col * hit.u + v3.col * hit.v);
+    hit_result.uv = (v1.uv * w + v2.uv * hit.u + v3.uv * hit.v);
     return hit_result;
 }
-static RayHitResult RayTriangleIntersection(const Ray& ray, const BoundingVolumeHierarchy::Triangle& triangle) {
-    return RayTriangleIntersection(ray, triangle.v1, triangle.v2, triangle.v3);
+// fetches and interpolates the surface attributes of the hit triangle
+static RayHitResult ResolveHit(const Ray& ray, const BoundingVolumeHierarchy& bvh, const RayTriangleHit& hit) {
+    if(!hit.Hit()) {
+        RayHitResult hit_result = {};
+        hit_result.hit = false;
+        hit_result.length = INFINITY;
+        return hit_result;
+    }
+    const BoundingVolumeHierarchy::Triangle& trig = bvh.triangles[hit.trig_idx];
+    RayHitResult hit_result = ResolveHit(ray, bvh.vertices[trig.idx_1], bvh.vertices[trig.idx_2], bvh.vertices[trig.idx_3], hit);
+    hit_result.triangle_idx = hit.trig_idx;
+    return hit_result;
 }
 // returns the distance to the bounding box
 // if the bounding box is missed, it returns INFINITY
@@ -73,186 +121,2247 @@ static float RayBoundingBoxIntersectionTest(const Ray& ray, const BoundingBox& b
     }
     return tmin;
 }
+// same as above with a precomputed inverse direction, boxes starting behind max_dist count as a miss
+static float RayBoundingBoxIntersectionTest(const glm::vec3& origin, const glm::vec3& inv_dir, const BoundingBox& bb, float max_dist) {
+    const glm::vec3 min_t = (bb.min - origin) * inv_dir;
+    const glm::vec3 max_t = (bb.max - origin) * inv_dir;
 
-static void NodeCalculateNext(const std::vector<BoundingVolumeHierarchy::Triangle>& triangles, BVHNode* cur_node, uint32_t cur_depth, uint32_t max_depth) {
-    if(cur_depth > max_depth || cur_node->triangle_idx.size() < 6) {
-        return;
+    const float tmin = glm::max(glm::max(glm::min(min_t.x, max_t.x), glm::min(min_t.y, max_t.y)), glm::min(min_t.z, max_t.z));
+    const float tmax = glm::min(glm::min(glm::max(min_t.x, max_t.x), glm::max(min_t.y, max_t.y)), glm::max(min_t.z, max_t.z));
+
+    if (tmax < 0.0f || tmin > tmax || tmin > max_dist) {
+        return INFINITY;
     }
-    glm::vec3 bb_sz = cur_node->bb.max - cur_node->bb.min;
-    BVHNode* child_1 = new BVHNode;
-    BVHNode* child_2 = new BVHNode;
-    child_1->child_1 = nullptr;
-    child_1->child_2 = nullptr;
-    child_2->child_1 = nullptr;
-    child_2->child_2 = nullptr;
-    child_1->bb = cur_node->bb;
-    child_2->bb = cur_node->bb;
+    return tmin;
+}
+
+static BoundingBox EmptyBoundingBox() {
+    BoundingBox bb;
+    bb.min = glm::vec3(INFINITY, INFINITY, INFINITY);
+    bb.max = glm::vec3(-INFINITY, -INFINITY, -INFINITY);
+    return bb;
+}
+static void ExpandBoundingBox(BoundingBox& bb, const glm::vec3& p) {
+    bb.min = glm::min(bb.min, p);
+    bb.max = glm::max(bb.max, p);
+}
+static void ExpandBoundingBox(BoundingBox& bb, const BoundingBox& other) {
+    bb.min = glm::min(bb.min, other.min);
+    bb.max = glm::max(bb.max, other.max);
+}
+static float BoundingBoxSurfaceArea(const BoundingBox& bb) {
+    const glm::vec3 sz = bb.max - bb.min;
+    if(sz.x < 0.0f || sz.y < 0.0f || sz.z < 0.0f) {
+        return 0.0f;
+    }
+    return 2.0f * (sz.x * sz.y + sz.y * sz.z + sz.z * sz.x);
+}
+static float BoundingBoxVolume(const BoundingBox& bb) {
+    const glm::vec3 sz = bb.max - bb.min;
+    if(sz.x < 0.0f || sz.y < 0.0f || sz.z < 0.0f) {
+        return 0.0f;
+    }
+    return sz.x * sz.y * sz.z;
+}
+static BoundingBox TransformBoundingBox(const BoundingBox& bb, const glm::mat4& mat) {
+    BoundingBox res = EmptyBoundingBox();
+    for(int i = 0; i < 8; ++i) {
+        const glm::vec3 corner = glm::vec3((i & 1) ? bb.max.x : bb.min.x, (i & 2) ? bb.max.y : bb.min.y, (i & 4) ? bb.max.z : bb.min.z);
+        ExpandBoundingBox(res, glm::vec3(mat * glm::vec4(corner, 1.0f)));
+    }
+    return res;
+}
+static BoundingBox TriangleBoundingBox(const glm::vec3& p1, const glm::vec3& p2, const glm::vec3& p3) {
+    BoundingBox bb;
+    bb.min = glm::min(p1, glm::min(p2, p3));
+    bb.max = glm::max(p1, glm::max(p2, p3));
+    return bb;
+}
+static void SetTriangleBlockLane(BoundingVolumeHierarchy::TriangleBlock& block, uint32_t lane, const glm::vec3& p1, const glm::vec3& p2, const glm::vec3& p3) {
+    const glm::vec3 e1 = p2 - p1;
+    const glm::vec3 e2 = p3 - p1;
+    for(int axis = 0; axis < 3; ++axis) {
+        block.v0[axis][lane] = p1[axis];
+        block.e1[axis][lane] = e1[axis];
+        block.e2[axis][lane] = e2[axis];
+    }
+}
+
+// a primitive as the builder sees it, idx points back into the original primitive list
+struct BVHBuildPrimitive {
+    BoundingBox bb;
+    glm::vec3 center;
+    uint32_t idx;
+};
+// nodes with more primitives than this are binned and partitioned by all threads,
+// smaller ones become a subtree task that a single thread builds on its own
+static constexpr uint32_t BVH_BUILD_PARALLEL_SIZE = 16 * 1024;
+static_assert(BVH_BUILD_PARALLEL_SIZE % BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE == 0, "chunks may not share triangle blocks");
+
+static uint32_t BuildChunkCount(uint32_t count) {
+    return (count + BVH_BUILD_PARALLEL_SIZE - 1) / BVH_BUILD_PARALLEL_SIZE;
+}
+// calls func(chunk, first, count) for every BVH_BUILD_PARALLEL_SIZE sized chunk of [0, count) on the thread pool
+template<typename F>
+static void ForEachBuildChunk(uint32_t count, const F& func) {
+    GetThreadPool().ParallelFor(BuildChunkCount(count), [&](uint32_t chunk, uint32_t) {
+        const uint32_t first = chunk * BVH_BUILD_PARALLEL_SIZE;
+        func(chunk, first, glm::min(BVH_BUILD_PARALLEL_SIZE, count - first));
+    });
+}
+static BoundingBox BuildPrimitivesBoundingBox(const BVHBuildPrimitive* prims, uint32_t count) {
+    BoundingBox bb = EmptyBoundingBox();
+    if(count > BVH_BUILD_PARALLEL_SIZE) {
+        std::vector<BoundingBox> chunk_bbs(BuildChunkCount(count));
+        ForEachBuildChunk(count, [&](uint32_t chunk, uint32_t first, uint32_t chunk_size) {
+            chunk_bbs[chunk] = BuildPrimitivesBoundingBox(prims + first, chunk_size);
+        });
+        for(const BoundingBox& chunk_bb : chunk_bbs) {
+            ExpandBoundingBox(bb, chunk_bb);
+        }
+        return bb;
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        ExpandBoundingBox(bb, prims[i].bb);
+    }
+    return bb;
+}
+static BoundingBox BuildPrimitivesCentroidBoundingBox(const BVHBuildPrimitive* prims, uint32_t count) {
+    BoundingBox bb = EmptyBoundingBox();
+    if(count > BVH_BUILD_PARALLEL_SIZE) {
+        std::vector<BoundingBox> chunk_bbs(BuildChunkCount(count));
+        ForEachBuildChunk(count, [&](uint32_t chunk, uint32_t first, uint32_t chunk_size) {
+            chunk_bbs[chunk] = BuildPrimitivesCentroidBoundingBox(prims + first, chunk_size);
+        });
+        for(const BoundingBox& chunk_bb : chunk_bbs) {
+            ExpandBoundingBox(bb, chunk_bb);
+        }
+        return bb;
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        ExpandBoundingBox(bb, prims[i].center);
+    }
+    return bb;
+}
+// moves every primitive that satisfies pred in front of the others and returns how many did
+// big ranges are partitioned stably in parallel through a scratch copy
+template<typename P>
+static uint32_t PartitionPrimitives(BVHBuildPrimitive* prims, uint32_t count, const P& pred) {
+    if(count <= BVH_BUILD_PARALLEL_SIZE) {
+        return std::partition(prims, prims + count, pred) - prims;
+    }
+    const uint32_t chunk_count = BuildChunkCount(count);
+    std::vector<uint32_t> left_offsets(chunk_count);
+    std::vector<uint32_t> right_offsets(chunk_count);
+    ForEachBuildChunk(count, [&](uint32_t chunk, uint32_t first, uint32_t chunk_size) {
+        uint32_t left_count = 0;
+        for(uint32_t i = first; i < first + chunk_size; ++i) {
+            left_count += pred(prims[i]) ? 1 : 0;
+        }
+        left_offsets[chunk] = left_count;
+    });
+    uint32_t total_left = 0;
+    for(uint32_t chunk = 0; chunk < chunk_count; ++chunk) {
+        const uint32_t left_count = left_offsets[chunk];
+        left_offsets[chunk] = total_left;
+        total_left += left_count;
+    }
+    for(uint32_t chunk = 0; chunk < chunk_count; ++chunk) {
+        // everything in front of this chunk that went right
+        right_offsets[chunk] = total_left + chunk * BVH_BUILD_PARALLEL_SIZE - left_offsets[chunk];
+    }
+    const std::vector<BVHBuildPrimitive> scratch(prims, prims + count);
+    ForEachBuildChunk(count, [&](uint32_t chunk, uint32_t first, uint32_t chunk_size) {
+        uint32_t left = left_offsets[chunk];
+        uint32_t right = right_offsets[chunk];
+        for(uint32_t i = first; i < first + chunk_size; ++i) {
+            if(pred(scratch[i])) {
+                prims[left++] = scratch[i];
+            }
+            else {
+                prims[right++] = scratch[i];
+            }
+        }
+    });
+    return total_left;
+}
+
+// returns the number of primitives that go into the first child
+// 0 means the node should stay a leaf
+static uint32_t NodeSplitMidpoint(BVHBuildPrimitive* prims, uint32_t count, const BoundingBox& node_bb, uint32_t cur_depth, const BVHBuildSettings& settings) {
+    if(cur_depth > settings.max_depth || count < 6) {
+        return 0;
+    }
+    const glm::vec3 bb_sz = node_bb.max - node_bb.min;
+    int axis = 1;
     if(bb_sz.x > bb_sz.y) {
-        if(bb_sz.x > bb_sz.z) {
-            const float new_x = cur_node->bb.min.x + bb_sz.x / 2.0f;
-            child_1->bb.max.x = new_x;
-            child_2->bb.min.x = new_x;
+        axis = bb_sz.x > bb_sz.z ? 0 : 2;
+    }
+    else if(bb_sz.z > bb_sz.y) {
+        axis = 2;
+    }
+    // both halves share the other two axes, so the closer half center is just the side of the plane
+    const float mid = node_bb.min[axis] + bb_sz[axis] / 2.0f;
+    const uint32_t left_count = PartitionPrimitives(prims, count, [axis, mid](const BVHBuildPrimitive& p) {
+        return p.center[axis] < mid;
+    });
+    if(left_count == 0 || left_count == count) {
+        // the non empty child is exactly the same as the cur_node
+        // so don't bother adding them
+        return 0;
+    }
+    return left_count;
+}
+struct BVHBuildBin {
+    BoundingBox bb;
+    uint32_t count;
+};
+static void BinPrimitives(const BVHBuildPrimitive* prims, uint32_t count, int axis, float min_c, float bin_scale, uint32_t bin_count, BVHBuildBin* bins) {
+    for(uint32_t b = 0; b < bin_count; ++b) {
+        bins[b].bb = EmptyBoundingBox();
+        bins[b].count = 0;
+    }
+    if(count > BVH_BUILD_PARALLEL_SIZE) {
+        std::vector<BVHBuildBin> chunk_bins(BuildChunkCount(count) * bin_count);
+        ForEachBuildChunk(count, [&](uint32_t chunk, uint32_t first, uint32_t chunk_size) {
+            BinPrimitives(prims + first, chunk_size, axis, min_c, bin_scale, bin_count, chunk_bins.data() + chunk * bin_count);
+        });
+        for(size_t i = 0; i < chunk_bins.size(); ++i) {
+            ExpandBoundingBox(bins[i % bin_count].bb, chunk_bins[i].bb);
+            bins[i % bin_count].count += chunk_bins[i].count;
         }
-        else {
-            const float new_z = cur_node->bb.min.z + bb_sz.z / 2.0f;
-            child_1->bb.max.z = new_z;
-            child_2->bb.min.z = new_z;
+        return;
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        const uint32_t b = glm::min((uint32_t)((prims[i].center[axis] - min_c) * bin_scale), bin_count - 1);
+        ExpandBoundingBox(bins[b].bb, prims[i].bb);
+        bins[b].count += 1;
+    }
+}
+// the cheapest binned object partition of a node
+struct BVHObjectSplit {
+    float cost = INFINITY;
+    // -1 if no plane separates the centroids
+    int axis = -1;
+    uint32_t split = 0;
+    uint32_t bin_count = 0;
+    float min_c = 0.0f;
+    float bin_scale = 0.0f;
+    BoundingBox left_bb;
+    BoundingBox right_bb;
+};
+static BVHObjectSplit FindObjectSplit(const BVHBuildPrimitive* prims, uint32_t count, const BoundingBox& node_bb, const BVHBuildSettings& settings) {
+    BVHObjectSplit res;
+    const BoundingBox centroid_bb = BuildPrimitivesCentroidBoundingBox(prims, count);
+    const glm::vec3 centroid_sz = centroid_bb.max - centroid_bb.min;
+    const uint32_t bin_count = glm::clamp(settings.bin_count, 2u, BVHBuildSettings::MAX_BIN_COUNT);
+    const float inv_node_area = 1.0f / glm::max(BoundingBoxSurfaceArea(node_bb), 1e-20f);
+    for(int axis = 0; axis < 3; ++axis) {
+        if(centroid_sz[axis] <= 0.0f) {
+            continue;
+        }
+        const float bin_scale = (float)bin_count / centroid_sz[axis];
+        BVHBuildBin bins[BVHBuildSettings::MAX_BIN_COUNT];
+        BinPrimitives(prims, count, axis, centroid_bb.min[axis], bin_scale, bin_count, bins);
+        // sweep from the right to get the cost of everything right of each split plane
+        BoundingBox right_bbs[BVHBuildSettings::MAX_BIN_COUNT];
+        uint32_t right_count[BVHBuildSettings::MAX_BIN_COUNT];
+        BoundingBox right_bb = EmptyBoundingBox();
+        uint32_t right_n = 0;
+        for(uint32_t b = bin_count - 1; b > 0; --b) {
+            ExpandBoundingBox(right_bb, bins[b].bb);
+            right_n += bins[b].count;
+            right_bbs[b] = right_bb;
+            right_count[b] = right_n;
+        }
+        BoundingBox left_bb = EmptyBoundingBox();
+        uint32_t left_n = 0;
+        for(uint32_t b = 1; b < bin_count; ++b) {
+            ExpandBoundingBox(left_bb, bins[b - 1].bb);
+            left_n += bins[b - 1].count;
+            if(left_n == 0 || right_count[b] == 0) {
+                continue;
+            }
+            const float cost = settings.traversal_cost + settings.intersection_cost * inv_node_area * (BoundingBoxSurfaceArea(left_bb) * left_n + BoundingBoxSurfaceArea(right_bbs[b]) * right_count[b]);
+            if(cost < res.cost) {
+                res.cost = cost;
+                res.axis = axis;
+                res.split = b;
+                res.bin_count = bin_count;
+                res.min_c = centroid_bb.min[axis];
+                res.bin_scale = bin_scale;
+                res.left_bb = left_bb;
+                res.right_bb = right_bbs[b];
+            }
         }
     }
-    else {
-        if(bb_sz.z > bb_sz.y) {
-            const float new_z = cur_node->bb.min.z + bb_sz.z / 2.0f;
-            child_1->bb.max.z = new_z;
-            child_2->bb.min.z = new_z;
+    return res;
+}
+static uint32_t PartitionObjectSplit(BVHBuildPrimitive* prims, uint32_t count, const BVHObjectSplit& split) {
+    const int axis = split.axis;
+    const uint32_t best_split = split.split;
+    const uint32_t bin_count = split.bin_count;
+    const float min_c = split.min_c;
+    const float bin_scale = split.bin_scale;
+    return PartitionPrimitives(prims, count, [=](const BVHBuildPrimitive& p) {
+        return glm::min((uint32_t)((p.center[axis] - min_c) * bin_scale), bin_count - 1) < best_split;
+    });
+}
+static uint32_t NodeSplitSAH(BVHBuildPrimitive* prims, uint32_t count, const BoundingBox& node_bb, uint32_t cur_depth, const BVHBuildSettings& settings) {
+    if(count <= settings.min_leaf_size || cur_depth >= settings.max_depth) {
+        return 0;
+    }
+    const float leaf_cost = settings.intersection_cost * (float)count;
+    const BVHObjectSplit split = FindObjectSplit(prims, count, node_bb, settings);
+    if(split.axis >= 0 && (split.cost < leaf_cost || count > settings.max_leaf_size)) {
+        return PartitionObjectSplit(prims, count, split);
+    }
+    else if(count > settings.max_leaf_size) {
+        // all centroids are in the same spot, no plane can separate them
+        // so just cut the list in half to respect the leaf size
+        return count / 2;
+    }
+    return 0;
+}
+
+static uint32_t CountLeadingZeros(uint32_t x) {
+    if(x == 0) {
+        return 32;
+    }
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long idx;
+    _BitScanReverse(&idx, x);
+    return 31 - (uint32_t)idx;
+#else
+    return (uint32_t)__builtin_clz(x);
+#endif
+}
+// spreads the lower 10 bits of x out so there are two zero bits between each of them
+static uint32_t ExpandMortonBits(uint32_t x) {
+    x = (x * 0x00010001u) & 0xFF0000FFu;
+    x = (x * 0x00000101u) & 0x0F00F00Fu;
+    x = (x * 0x00000011u) & 0xC30C30C3u;
+    x = (x * 0x00000005u) & 0x49249249u;
+    return x;
+}
+// 30 bit morton code of a point in [0, 1]^3
+static uint32_t MortonCode(const glm::vec3& p) {
+    const glm::vec3 q = glm::clamp(p * 1024.0f, 0.0f, 1023.0f);
+    return (ExpandMortonBits((uint32_t)q.x) << 2) | (ExpandMortonBits((uint32_t)q.y) << 1) | ExpandMortonBits((uint32_t)q.z);
+}
+// sorts prims by the morton code of their centroid, out_codes receives the sorted codes
+// least significant digit radix sort, every pass counts and scatters in parallel chunks and keeps equal codes in input order
+static void SortPrimitivesMorton(std::vector<BVHBuildPrimitive>& prims, std::vector<uint32_t>& out_codes) {
+    static constexpr uint32_t RADIX_BITS = 8;
+    static constexpr uint32_t RADIX_SIZE = 1u << RADIX_BITS;
+    const uint32_t count = prims.size();
+    const uint32_t chunk_count = BuildChunkCount(count);
+    const BoundingBox centroid_bb = BuildPrimitivesCentroidBoundingBox(prims.data(), count);
+    const glm::vec3 inv_size = 1.0f / glm::max(centroid_bb.max - centroid_bb.min, glm::vec3(1e-20f));
+
+    std::vector<uint32_t> codes(count);
+    std::vector<uint32_t> order(count);
+    ForEachBuildChunk(count, [&](uint32_t, uint32_t first, uint32_t chunk_size) {
+        for(uint32_t i = first; i < first + chunk_size; ++i) {
+            codes[i] = MortonCode((prims[i].center - centroid_bb.min) * inv_size);
+            order[i] = i;
         }
-        else {
-            const float new_y = cur_node->bb.min.y + bb_sz.y / 2.0f;
-            child_1->bb.max.y = new_y;
-            child_2->bb.min.y = new_y;
+    });
+    std::vector<uint32_t> tmp_codes(count);
+    std::vector<uint32_t> tmp_order(count);
+    std::vector<uint32_t> offsets(chunk_count * RADIX_SIZE);
+    for(uint32_t shift = 0; shift < 30; shift += RADIX_BITS) {
+        ForEachBuildChunk(count, [&](uint32_t chunk, uint32_t first, uint32_t chunk_size) {
+            uint32_t* histogram = offsets.data() + chunk * RADIX_SIZE;
+            std::fill(histogram, histogram + RADIX_SIZE, 0u);
+            for(uint32_t i = first; i < first + chunk_size; ++i) {
+                histogram[(codes[i] >> shift) & (RADIX_SIZE - 1)] += 1;
+            }
+        });
+        // turn the per chunk histograms into scatter offsets, digit major so the sort stays stable
+        uint32_t sum = 0;
+        for(uint32_t digit = 0; digit < RADIX_SIZE; ++digit) {
+            for(uint32_t chunk = 0; chunk < chunk_count; ++chunk) {
+                const uint32_t digit_count = offsets[chunk * RADIX_SIZE + digit];
+                offsets[chunk * RADIX_SIZE + digit] = sum;
+                sum += digit_count;
+            }
         }
+        ForEachBuildChunk(count, [&](uint32_t chunk, uint32_t first, uint32_t chunk_size) {
+            uint32_t* chunk_offsets = offsets.data() + chunk * RADIX_SIZE;
+            for(uint32_t i = first; i < first + chunk_size; ++i) {
+                const uint32_t dst = chunk_offsets[(codes[i] >> shift) & (RADIX_SIZE - 1)]++;
+                tmp_codes[dst] = codes[i];
+                tmp_order[dst] = order[i];
+            }
+        });
+        codes.swap(tmp_codes);
+        order.swap(tmp_order);
     }
-    for(uint32_t v : cur_node->triangle_idx) {
-        auto& trig = triangles.at(v);
-        const glm::vec3 bb1_center = (child_1->bb.min + child_1->bb.max) / 2.0f;
-        const glm::vec3 bb2_center = (child_2->bb.min + child_2->bb.max) / 2.0f;
-        const float len_1 = glm::length(trig.center - bb1_center);
-        const float len_2 = glm::length(trig.center - bb2_center);
-        if(len_1 < len_2) {
-            child_1->triangle_idx.push_back(v);
+
+    std::vector<BVHBuildPrimitive> sorted(count);
+    ForEachBuildChunk(count, [&](uint32_t, uint32_t first, uint32_t chunk_size) {
+        for(uint32_t i = first; i < first + chunk_size; ++i) {
+            sorted[i] = prims[order[i]];
         }
-        else {
-            child_2->triangle_idx.push_back(v);
+    });
+    prims.swap(sorted);
+    out_codes.swap(codes);
+}
+// splits a sorted run of morton codes where the highest differing bit changes, codes don't get reordered
+static uint32_t NodeSplitMorton(const uint32_t* codes, uint32_t count, uint32_t cur_depth, const BVHBuildSettings& settings) {
+    if(count <= glm::max(settings.min_leaf_size, 1u) || cur_depth >= settings.max_depth) {
+        return 0;
+    }
+    const uint32_t first_code = codes[0];
+    const uint32_t last_code = codes[count - 1];
+    if(first_code == last_code) {
+        // the centroids fell into the same cell, nothing left to split on
+        return count / 2;
+    }
+    const uint32_t common_prefix = CountLeadingZeros(first_code ^ last_code);
+    // binary search for the last code that still shares more than common_prefix bits with the first one
+    uint32_t split = 0;
+    uint32_t step = count - 1;
+    do {
+        step = (step + 1) >> 1;
+        const uint32_t new_split = split + step;
+        if(new_split < count - 1 && CountLeadingZeros(first_code ^ codes[new_split]) > common_prefix) {
+            split = new_split;
         }
+    } while(step > 1);
+    return split + 1;
+}
+
+// SAH cost of the subtree below idx relative to its own bounds, every node of it must be built already
+static float SubtreeSAHCost(const std::vector<BVHNode>& nodes, uint32_t idx, const BVHBuildSettings& settings) {
+    const BVHNode& node = nodes[idx];
+    if(node.triangle_count > 0) {
+        return settings.intersection_cost * (float)node.triangle_count;
+    }
+    const uint32_t left = idx + 1;
+    const uint32_t right = node.offset;
+    const float inv_area = 1.0f / glm::max(BoundingBoxSurfaceArea(node.bb), 1e-20f);
+    return settings.traversal_cost + inv_area * (BoundingBoxSurfaceArea(nodes[left].bb) * SubtreeSAHCost(nodes, left, settings) + BoundingBoxSurfaceArea(nodes[right].bb) * SubtreeSAHCost(nodes, right, settings));
+}
+
+// a subtree below BVH_BUILD_PARALLEL_SIZE primitives, built by one thread into its own node list
+// its interior node offsets are relative to the subtree root, leaf offsets index the shared primitive list
+struct BVHBuildTask {
+    static constexpr uint32_t PLACEHOLDER = 0xFFFFFFFFu;
+    uint32_t first;
+    uint32_t count;
+    uint32_t depth;
+    std::vector<BVHNode> nodes;
+    // added to the leaf offsets when splicing, for builders whose subtrees emit their own primitive list
+    uint32_t leaf_base = 0;
+    // SAH_SPATIAL only: the references of the subtree, replaced by its leaf ordered references once built
+    std::vector<BVHBuildPrimitive> refs;
+    float budget = 0.0f;
+};
+
+// emits the nodes depth first, the first child always directly follows its parent
+// with tasks set, small subtrees are not built but left as a placeholder node
+// (triangle_count == BVHBuildTask::PLACEHOLDER, offset == task index)
+static void BuildNodesRecursive(std::vector<BVHNode>& nodes, BVHBuildPrimitive* prims, const uint32_t* morton_codes, uint32_t first, uint32_t count, uint32_t cur_depth, const BVHBuildSettings& settings, std::vector<BVHBuildTask>* tasks) {
+    const uint32_t node_idx = nodes.size();
+    nodes.push_back({});
+    if(tasks && count <= BVH_BUILD_PARALLEL_SIZE) {
+        nodes[node_idx].offset = tasks->size();
+        nodes[node_idx].triangle_count = BVHBuildTask::PLACEHOLDER;
+        BVHBuildTask task;
+        task.first = first;
+        task.count = count;
+        task.depth = cur_depth;
+        tasks->push_back(std::move(task));
+        return;
     }
-    // expand the bounding boxes to include all triangles fully
-    for(uint32_t v : child_1->triangle_idx) {
-        auto& trig = triangles.at(v);
-        child_1->bb.max = glm::max(trig.v3.pos, glm::max(trig.v2.pos, glm::max(trig.v1.pos, child_1->bb.max)));
-        child_1->bb.min = glm::min(trig.v3.pos, glm::min(trig.v2.pos, glm::min(trig.v1.pos, child_1->bb.min)));
+    // the morton split doesn't look at the node bounds, so they are gathered bottom up instead
+    const bool linear = settings.mode == BVHBuildSettings::LINEAR_MORTON;
+    if(!linear) {
+        nodes[node_idx].bb = BuildPrimitivesBoundingBox(prims + first, count);
     }
-    for(uint32_t v : child_2->triangle_idx) {
-        auto& trig = triangles.at(v);
-        child_2->bb.max = glm::max(trig.v3.pos, glm::max(trig.v2.pos, glm::max(trig.v1.pos, child_2->bb.max)));
-        child_2->bb.min = glm::min(trig.v3.pos, glm::min(trig.v2.pos, glm::min(trig.v1.pos, child_2->bb.min)));
+
+    uint32_t left_count = 0;
+    if(linear) {
+        left_count = NodeSplitMorton(morton_codes + first, count, cur_depth, settings);
     }
-    if(child_1->triangle_idx.empty() || child_2->triangle_idx.empty()) {
-        // the non empty child is exactly the same as the cur_node
-        // so don't bother adding them
-        delete child_1;
-        delete child_2;
+    else if(settings.mode == BVHBuildSettings::SAH_BINNED || settings.mode == BVHBuildSettings::SAH_SPATIAL) {
+        // spatial splits need the triangles (see BuildNodesSpatial), without them this is a plain SAH build
+        left_count = NodeSplitSAH(prims + first, count, nodes[node_idx].bb, cur_depth, settings);
     }
     else {
-        cur_node->child_1 = child_1;
-        cur_node->child_2 = child_2;
-        NodeCalculateNext(triangles, cur_node->child_1, cur_depth + 1, max_depth);
-        NodeCalculateNext(triangles, cur_node->child_2, cur_depth + 1, max_depth);
+        left_count = NodeSplitMidpoint(prims + first, count, nodes[node_idx].bb, cur_depth, settings);
+    }
+
+    if(left_count == 0) {
+        nodes[node_idx].offset = first;
+        nodes[node_idx].triangle_count = count;
+        if(linear) {
+            nodes[node_idx].bb = BuildPrimitivesBoundingBox(prims + first, count);
+        }
+        return;
+    }
+    BuildNodesRecursive(nodes, prims, morton_codes, first, left_count, cur_depth + 1, settings, tasks);
+    nodes[node_idx].offset = nodes.size();
+    nodes[node_idx].triangle_count = 0;
+    BuildNodesRecursive(nodes, prims, morton_codes, first + left_count, count - left_count, cur_depth + 1, settings, tasks);
+    if(linear) {
+        nodes[node_idx].bb = nodes[node_idx + 1].bb;
+        ExpandBoundingBox(nodes[node_idx].bb, nodes[nodes[node_idx].offset].bb);
+        // morton splits run down to single triangles, collapse small subtrees back into a leaf where the SAH prefers that
+        if(count <= settings.max_leaf_size && settings.intersection_cost * (float)count <= SubtreeSAHCost(nodes, node_idx, settings)) {
+            nodes.resize(node_idx + 1);
+            nodes[node_idx].offset = first;
+            nodes[node_idx].triangle_count = count;
+        }
     }
 }
 
+// the top nodes are depth first with one placeholder per task, replacing every
+// placeholder by its subtree in place keeps the whole array depth first
+// returns where every top node ended up
+static std::vector<uint32_t> SpliceBuildTasks(std::vector<BVHNode>& nodes, const std::vector<BVHNode>& top_nodes, const std::vector<BVHBuildTask>& tasks) {
+    size_t total_count = top_nodes.size();
+    for(const BVHBuildTask& task : tasks) {
+        total_count += task.nodes.size() - 1;
+    }
+    nodes.clear();
+    nodes.reserve(total_count);
+    std::vector<uint32_t> new_idx(top_nodes.size());
+    for(size_t i = 0; i < top_nodes.size(); ++i) {
+        new_idx[i] = nodes.size();
+        if(top_nodes[i].triangle_count != BVHBuildTask::PLACEHOLDER) {
+            nodes.push_back(top_nodes[i]);
+            continue;
+        }
+        const BVHBuildTask& task = tasks[top_nodes[i].offset];
+        const uint32_t base = nodes.size();
+        for(BVHNode node : task.nodes) {
+            node.offset += node.triangle_count == 0 ? base : task.leaf_base;
+            nodes.push_back(node);
+        }
+    }
+    for(size_t i = 0; i < top_nodes.size(); ++i) {
+        if(top_nodes[i].triangle_count == 0) {
+            nodes[new_idx[i]].offset = new_idx[top_nodes[i].offset];
+        }
+    }
+    return new_idx;
+}
+
+// builds the tree over prims and reorders prims into leaf order
+// the top levels are split with all threads, then every remaining subtree is built as its own job
+static void BuildNodes(std::vector<BVHNode>& nodes, std::vector<BVHBuildPrimitive>& prims, const BVHBuildSettings& settings) {
+    nodes.clear();
+    if(prims.empty()) {
+        return;
+    }
+    // the traversal uses a fixed size stack, which bounds the tree depth
+    BVHBuildSettings clamped_settings = settings;
+    clamped_settings.max_depth = glm::min(settings.max_depth, BoundingVolumeHierarchy::MAX_DEPTH);
+
+    std::vector<uint32_t> morton_codes;
+    if(settings.mode == BVHBuildSettings::LINEAR_MORTON) {
+        SortPrimitivesMorton(prims, morton_codes);
+    }
+
+    std::vector<BVHNode> top_nodes;
+    std::vector<BVHBuildTask> tasks;
+    BuildNodesRecursive(top_nodes, prims.data(), morton_codes.data(), 0, prims.size(), 0, clamped_settings, &tasks);
+    GetThreadPool().ParallelFor(tasks.size(), [&](uint32_t task_idx, uint32_t) {
+        BVHBuildTask& task = tasks[task_idx];
+        task.nodes.reserve(2 * task.count);
+        BuildNodesRecursive(task.nodes, prims.data(), morton_codes.data(), task.first, task.count, task.depth, clamped_settings, nullptr);
+    });
+
+    const std::vector<uint32_t> new_idx = SpliceBuildTasks(nodes, top_nodes, tasks);
+    if(settings.mode == BVHBuildSettings::LINEAR_MORTON) {
+        // the top nodes were merged from placeholders, redo them now that the subtrees exist
+        // children always come after their parent, so walking backwards sees them first
+        for(size_t i = top_nodes.size(); i-- > 0;) {
+            BVHNode& node = nodes[new_idx[i]];
+            if(top_nodes[i].triangle_count == 0) {
+                node.bb = nodes[new_idx[i] + 1].bb;
+                ExpandBoundingBox(node.bb, nodes[node.offset].bb);
+            }
+        }
+    }
+}
+
+// SAH_SPATIAL works on triangle references instead of triangles, a triangle that straddles a
+// spatial split plane ends up referenced from both children with its bounds clipped to each side
+struct BVHSpatialContext {
+    // mesh triangles, indexed by BVHBuildPrimitive::idx
+    const BoundingVolumeHierarchy::Triangle* triangles;
+    const Vertex* vertices;
+    float root_area;
+};
+static bool BoundingBoxValid(const BoundingBox& bb) {
+    return bb.min.x <= bb.max.x && bb.min.y <= bb.max.y && bb.min.z <= bb.max.z;
+}
+static BoundingBox IntersectBoundingBox(const BoundingBox& a, const BoundingBox& b) {
+    BoundingBox res;
+    res.min = glm::max(a.min, b.min);
+    res.max = glm::min(a.max, b.max);
+    return res;
+}
+// bounds of the part of the triangle that lies between lo and hi along axis
+static BoundingBox ClipTriangleBoundingBox(const glm::vec3 p[3], int axis, float lo, float hi) {
+    BoundingBox bb = EmptyBoundingBox();
+    for(int i = 0; i < 3; ++i) {
+        const glm::vec3& a = p[i];
+        const glm::vec3& b = p[(i + 1) % 3];
+        if(a[axis] >= lo && a[axis] <= hi) {
+            ExpandBoundingBox(bb, a);
+        }
+        for(const float plane : {lo, hi}) {
+            if((a[axis] < plane) != (b[axis] < plane)) {
+                glm::vec3 q = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+                q[axis] = plane;
+                ExpandBoundingBox(bb, q);
+            }
+        }
+    }
+    return bb;
+}
+static BoundingBox ClipReference(const BVHSpatialContext& ctx, const BVHBuildPrimitive& ref, int axis, float lo, float hi) {
+    const BoundingVolumeHierarchy::Triangle& trig = ctx.triangles[ref.idx];
+    const glm::vec3 p[3] = {ctx.vertices[trig.idx_1].pos, ctx.vertices[trig.idx_2].pos, ctx.vertices[trig.idx_3].pos};
+    return IntersectBoundingBox(ClipTriangleBoundingBox(p, axis, lo, hi), ref.bb);
+}
+static BVHBuildPrimitive MakeReference(const BVHBuildPrimitive& ref, const BoundingBox& bb) {
+    BVHBuildPrimitive res;
+    res.bb = bb;
+    res.center = (bb.min + bb.max) * 0.5f;
+    res.idx = ref.idx;
+    return res;
+}
+
+// the cheapest spatial split of a node, counts include the references on both sides of the plane
+struct BVHSpatialSplit {
+    float cost = INFINITY;
+    int axis = -1;
+    float position = 0.0f;
+    BoundingBox left_bb;
+    BoundingBox right_bb;
+    uint32_t left_count = 0;
+    uint32_t right_count = 0;
+};
+static BVHSpatialSplit FindSpatialSplit(const BVHSpatialContext& ctx, const std::vector<BVHBuildPrimitive>& refs, const BoundingBox& node_bb, const BVHBuildSettings& settings) {
+    struct Bin {
+        BoundingBox bb;
+        // references that start / end in this bin
+        uint32_t enter;
+        uint32_t exit;
+    };
+    BVHSpatialSplit res;
+    const uint32_t bin_count = glm::clamp(settings.bin_count, 2u, BVHBuildSettings::MAX_BIN_COUNT);
+    const float inv_node_area = 1.0f / glm::max(BoundingBoxSurfaceArea(node_bb), 1e-20f);
+    for(int axis = 0; axis < 3; ++axis) {
+        const float extent = node_bb.max[axis] - node_bb.min[axis];
+        if(extent <= 0.0f) {
+            continue;
+        }
+        const float bin_width = extent / (float)bin_count;
+        Bin bins[BVHBuildSettings::MAX_BIN_COUNT];
+        for(uint32_t b = 0; b < bin_count; ++b) {
+            bins[b].bb = EmptyBoundingBox();
+            bins[b].enter = 0;
+            bins[b].exit = 0;
+        }
+        for(const BVHBuildPrimitive& ref : refs) {
+            const int first_bin = glm::clamp((int)((ref.bb.min[axis] - node_bb.min[axis]) / bin_width), 0, (int)bin_count - 1);
+            const int last_bin = glm::clamp((int)((ref.bb.max[axis] - node_bb.min[axis]) / bin_width), first_bin, (int)bin_count - 1);
+            if(first_bin == last_bin) {
+                ExpandBoundingBox(bins[first_bin].bb, ref.bb);
+            }
+            else {
+                // chop the triangle into every bin it crosses
+                for(int b = first_bin; b <= last_bin; ++b) {
+                    const float lo = node_bb.min[axis] + bin_width * b;
+                    const float hi = b == (int)bin_count - 1 ? node_bb.max[axis] : lo + bin_width;
+                    const BoundingBox clipped = ClipReference(ctx, ref, axis, lo, hi);
+                    if(BoundingBoxValid(clipped)) {
+                        ExpandBoundingBox(bins[b].bb, clipped);
+                    }
+                }
+            }
+            bins[first_bin].enter += 1;
+            bins[last_bin].exit += 1;
+        }
+        BoundingBox right_bbs[BVHBuildSettings::MAX_BIN_COUNT];
+        uint32_t right_count[BVHBuildSettings::MAX_BIN_COUNT];
+        BoundingBox right_bb = EmptyBoundingBox();
+        uint32_t right_n = 0;
+        for(uint32_t b = bin_count - 1; b > 0; --b) {
+            ExpandBoundingBox(right_bb, bins[b].bb);
+            right_n += bins[b].exit;
+            right_bbs[b] = right_bb;
+            right_count[b] = right_n;
+        }
+        BoundingBox left_bb = EmptyBoundingBox();
+        uint32_t left_n = 0;
+        for(uint32_t b = 1; b < bin_count; ++b) {
+            ExpandBoundingBox(left_bb, bins[b - 1].bb);
+            left_n += bins[b - 1].enter;
+            if(left_n == 0 || right_count[b] == 0) {
+                continue;
+            }
+            const float cost = settings.traversal_cost + settings.intersection_cost * inv_node_area * (BoundingBoxSurfaceArea(left_bb) * left_n + BoundingBoxSurfaceArea(right_bbs[b]) * right_count[b]);
+            if(cost < res.cost) {
+                res.cost = cost;
+                res.axis = axis;
+                res.position = node_bb.min[axis] + bin_width * b;
+                res.left_bb = left_bb;
+                res.right_bb = right_bbs[b];
+                res.left_count = left_n;
+                res.right_count = right_count[b];
+            }
+        }
+    }
+    return res;
+}
+static void PartitionSpatialSplit(const BVHSpatialContext& ctx, const std::vector<BVHBuildPrimitive>& refs, const BVHSpatialSplit& split, std::vector<BVHBuildPrimitive>& left, std::vector<BVHBuildPrimitive>& right) {
+    const int axis = split.axis;
+    const float pos = split.position;
+    BoundingBox left_bb = split.left_bb;
+    BoundingBox right_bb = split.right_bb;
+    uint32_t left_n = split.left_count;
+    uint32_t right_n = split.right_count;
+    for(const BVHBuildPrimitive& ref : refs) {
+        if(ref.bb.max[axis] <= pos) {
+            left.push_back(ref);
+            continue;
+        }
+        if(ref.bb.min[axis] >= pos) {
+            right.push_back(ref);
+            continue;
+        }
+        // reference unsplitting: keep the whole reference on one side if that is cheaper than duplicating it
+        BoundingBox left_grown = left_bb;
+        BoundingBox right_grown = right_bb;
+        ExpandBoundingBox(left_grown, ref.bb);
+        ExpandBoundingBox(right_grown, ref.bb);
+        const float split_cost = BoundingBoxSurfaceArea(left_bb) * left_n + BoundingBoxSurfaceArea(right_bb) * right_n;
+        const float left_cost = BoundingBoxSurfaceArea(left_grown) * left_n + BoundingBoxSurfaceArea(right_bb) * (right_n - 1);
+        const float right_cost = BoundingBoxSurfaceArea(left_bb) * (left_n - 1) + BoundingBoxSurfaceArea(right_grown) * right_n;
+        if(left_cost < split_cost && left_cost <= right_cost) {
+            left.push_back(ref);
+            left_bb = left_grown;
+            right_n -= 1;
+            continue;
+        }
+        if(right_cost < split_cost) {
+            right.push_back(ref);
+            right_bb = right_grown;
+            left_n -= 1;
+            continue;
+        }
+        const BoundingBox left_part = ClipReference(ctx, ref, axis, ref.bb.min[axis], pos);
+        const BoundingBox right_part = ClipReference(ctx, ref, axis, pos, ref.bb.max[axis]);
+        const bool left_valid = BoundingBoxValid(left_part);
+        const bool right_valid = BoundingBoxValid(right_part);
+        if(left_valid) {
+            left.push_back(MakeReference(ref, left_part));
+        }
+        if(right_valid) {
+            right.push_back(MakeReference(ref, right_part));
+        }
+        if(!left_valid && !right_valid) {
+            // only numerical noise touches the plane
+            left.push_back(ref);
+        }
+    }
+}
+
+// like BuildNodesRecursive, but every node owns its reference list since spatial splits can grow it
+// leaves append their references to out_refs, budget is the number of duplicates this subtree may still add
+static void BuildNodesSpatialRecursive(std::vector<BVHNode>& nodes, std::vector<BVHBuildPrimitive>& refs, float budget, uint32_t cur_depth, const BVHBuildSettings& settings, const BVHSpatialContext& ctx, std::vector<BVHBuildPrimitive>& out_refs, std::vector<BVHBuildTask>* tasks) {
+    const uint32_t node_idx = nodes.size();
+    const uint32_t count = refs.size();
+    nodes.push_back({});
+    if(tasks && count <= BVH_BUILD_PARALLEL_SIZE) {
+        nodes[node_idx].offset = tasks->size();
+        nodes[node_idx].triangle_count = BVHBuildTask::PLACEHOLDER;
+        BVHBuildTask task;
+        task.first = 0;
+        task.count = count;
+        task.depth = cur_depth;
+        task.refs = std::move(refs);
+        task.budget = budget;
+        tasks->push_back(std::move(task));
+        return;
+    }
+    nodes[node_idx].bb = BuildPrimitivesBoundingBox(refs.data(), count);
+
+    std::vector<BVHBuildPrimitive> left;
+    std::vector<BVHBuildPrimitive> right;
+    if(count > settings.min_leaf_size && cur_depth < settings.max_depth) {
+        const BoundingBox node_bb = nodes[node_idx].bb;
+        const BVHObjectSplit object_split = FindObjectSplit(refs.data(), count, node_bb, settings);
+        BVHSpatialSplit spatial_split;
+        if(budget >= 1.0f) {
+            // spatial splits only pay off where the object split can't separate the triangles
+            const BoundingBox overlap = IntersectBoundingBox(object_split.left_bb, object_split.right_bb);
+            if(object_split.axis < 0 || (BoundingBoxValid(overlap) && BoundingBoxSurfaceArea(overlap) > settings.spatial_split_alpha * ctx.root_area)) {
+                spatial_split = FindSpatialSplit(ctx, refs, node_bb, settings);
+            }
+        }
+        const float leaf_cost = settings.intersection_cost * (float)count;
+        if(glm::min(object_split.cost, spatial_split.cost) < leaf_cost || count > settings.max_leaf_size) {
+            if(spatial_split.cost < object_split.cost) {
+                PartitionSpatialSplit(ctx, refs, spatial_split, left, right);
+                if(left.empty() || right.empty() || (float)(left.size() + right.size() - count) > budget) {
+                    left.clear();
+                    right.clear();
+                }
+            }
+            if(left.empty() && object_split.axis >= 0) {
+                const uint32_t left_count = PartitionObjectSplit(refs.data(), count, object_split);
+                left.assign(refs.begin(), refs.begin() + left_count);
+                right.assign(refs.begin() + left_count, refs.end());
+            }
+        }
+        if(left.empty() && count > settings.max_leaf_size) {
+            // all centroids are in the same spot, just cut the list in half to respect the leaf size
+            left.assign(refs.begin(), refs.begin() + count / 2);
+            right.assign(refs.begin() + count / 2, refs.end());
+        }
+    }
+    if(left.empty()) {
+        nodes[node_idx].offset = out_refs.size();
+        nodes[node_idx].triangle_count = count;
+        out_refs.insert(out_refs.end(), refs.begin(), refs.end());
+        return;
+    }
+    // whatever this split didn't use is shared between the children by size
+    const float remaining = budget - (float)(left.size() + right.size() - count);
+    const float left_budget = remaining * (float)left.size() / (float)(left.size() + right.size());
+    std::vector<BVHBuildPrimitive>().swap(refs);
+    BuildNodesSpatialRecursive(nodes, left, left_budget, cur_depth + 1, settings, ctx, out_refs, tasks);
+    nodes[node_idx].offset = nodes.size();
+    nodes[node_idx].triangle_count = 0;
+    BuildNodesSpatialRecursive(nodes, right, remaining - left_budget, cur_depth + 1, settings, ctx, out_refs, tasks);
+}
+// SAH_SPATIAL version of BuildNodes, prims are replaced by the (possibly duplicated) references in leaf order
+static void BuildNodesSpatial(std::vector<BVHNode>& nodes, std::vector<BVHBuildPrimitive>& prims, const BVHBuildSettings& settings, const BoundingVolumeHierarchy::Triangle* triangles, const Vertex* vertices) {
+    nodes.clear();
+    if(prims.empty()) {
+        return;
+    }
+    BVHBuildSettings clamped_settings = settings;
+    clamped_settings.max_depth = glm::min(settings.max_depth, BoundingVolumeHierarchy::MAX_DEPTH);
+    BVHSpatialContext ctx;
+    ctx.triangles = triangles;
+    ctx.vertices = vertices;
+    ctx.root_area = BoundingBoxSurfaceArea(BuildPrimitivesBoundingBox(prims.data(), prims.size()));
+    const float budget = glm::max(settings.spatial_split_budget, 0.0f) * (float)prims.size();
+
+    std::vector<BVHBuildPrimitive> refs;
+    refs.swap(prims);
+    std::vector<BVHNode> top_nodes;
+    std::vector<BVHBuildTask> tasks;
+    BuildNodesSpatialRecursive(top_nodes, refs, budget, 0, clamped_settings, ctx, prims, &tasks);
+    GetThreadPool().ParallelFor(tasks.size(), [&](uint32_t task_idx, uint32_t) {
+        BVHBuildTask& task = tasks[task_idx];
+        std::vector<BVHBuildPrimitive> task_refs;
+        task_refs.swap(task.refs);
+        task.nodes.reserve(2 * task.count);
+        BuildNodesSpatialRecursive(task.nodes, task_refs, task.budget, task.depth, clamped_settings, ctx, task.refs, nullptr);
+    });
+    // leaves only need contiguous ranges, so the subtree references simply go after the top level ones
+    for(BVHBuildTask& task : tasks) {
+        task.leaf_base = prims.size();
+        prims.insert(prims.end(), task.refs.begin(), task.refs.end());
+    }
+    SpliceBuildTasks(nodes, top_nodes, tasks);
+}
+
+static BoundingBox LeafBoundingBox(const BoundingVolumeHierarchy& bvh, uint32_t first, uint32_t count) {
+    BoundingBox bb = EmptyBoundingBox();
+    for(uint32_t i = first; i < first + count; ++i) {
+        const BoundingVolumeHierarchy::Triangle& trig = bvh.triangles[i];
+        ExpandBoundingBox(bb, bvh.vertices[trig.idx_1].pos);
+        ExpandBoundingBox(bb, bvh.vertices[trig.idx_2].pos);
+        ExpandBoundingBox(bb, bvh.vertices[trig.idx_3].pos);
+    }
+    return bb;
+}
+static void RefitNode(BoundingVolumeHierarchy& bvh, uint32_t node_idx) {
+    BVHNode& node = bvh.nodes[node_idx];
+    if(node.triangle_count != 0) {
+        node.bb = LeafBoundingBox(bvh, node.offset, node.triangle_count);
+    }
+    else {
+        node.bb = bvh.nodes[node_idx + 1].bb;
+        ExpandBoundingBox(node.bb, bvh.nodes[node.offset].bb);
+    }
+}
 void BoundingVolumeHierarchy::CreateFromMesh(const Mesh* mesh, uint32_t max_steps) {
-    this->root_node.bb = mesh->bb;
-    this->triangle_data.reserve(mesh->triangle_count);
-    this->root_node.triangle_idx.reserve(mesh->triangle_count);
-    for(size_t i = 0; i < mesh->triangle_count; ++i) {
-        uint32_t idx_1 = 3 * i + 0;
-        uint32_t idx_2 = 3 * i + 1;
-        uint32_t idx_3 = 3 * i + 2;
-        if(mesh->inds) {
-            idx_1 = mesh->inds[idx_1];
-            idx_2 = mesh->inds[idx_2];
-            idx_3 = mesh->inds[idx_3];
-        }
-
-        auto& v1 = mesh->verts[idx_1];
-        auto& v2 = mesh->verts[idx_2];
-        auto& v3 = mesh->verts[idx_3];
-        Triangle cur_triangle = {};
-        cur_triangle.v1 = v1;
-        cur_triangle.v2 = v2;
-        cur_triangle.v3 = v3;
-        cur_triangle.center = (v1.pos + v2.pos + v3.pos) / 3.0f;
-        this->triangle_data.push_back(cur_triangle);
-        this->root_node.triangle_idx.push_back(i);
-    }
-    NodeCalculateNext(this->triangle_data, &this->root_node, 0, max_steps);
-}
-static void DestoryBoundingVolumeHierarchyNode(BVHNode* node) {
-    if(node->child_1) {
-        DestoryBoundingVolumeHierarchyNode(node->child_1);
-    }
-    if(node->child_2) {
-        DestoryBoundingVolumeHierarchyNode(node->child_2);
-    }
-    delete node;
+    BVHBuildSettings settings;
+    settings.mode = BVHBuildSettings::MIDPOINT_SPLIT;
+    settings.max_depth = max_steps;
+    this->CreateFromMesh(mesh, settings);
+}
+void BoundingVolumeHierarchy::CreateFromMesh(const Mesh* mesh, const BVHBuildSettings& settings) {
+    this->Destroy();
+    this->settings = settings;
+    this->mesh_triangle_count = mesh->triangle_count;
+    this->vertices.assign(mesh->verts, mesh->verts + mesh->vertex_count);
+    std::vector<Triangle> mesh_triangles(mesh->triangle_count);
+    std::vector<BVHBuildPrimitive> prims(mesh->triangle_count);
+    ForEachBuildChunk(mesh->triangle_count, [&](uint32_t, uint32_t first, uint32_t chunk_size) {
+        for(uint32_t i = first; i < first + chunk_size; ++i) {
+            Triangle cur_triangle;
+            cur_triangle.idx_1 = 3 * i + 0;
+            cur_triangle.idx_2 = 3 * i + 1;
+            cur_triangle.idx_3 = 3 * i + 2;
+            if(mesh->inds) {
+                cur_triangle.idx_1 = mesh->inds[cur_triangle.idx_1];
+                cur_triangle.idx_2 = mesh->inds[cur_triangle.idx_2];
+                cur_triangle.idx_3 = mesh->inds[cur_triangle.idx_3];
+            }
+            mesh_triangles[i] = cur_triangle;
+
+            const glm::vec3& p1 = mesh->verts[cur_triangle.idx_1].pos;
+            const glm::vec3& p2 = mesh->verts[cur_triangle.idx_2].pos;
+            const glm::vec3& p3 = mesh->verts[cur_triangle.idx_3].pos;
+            BVHBuildPrimitive& prim = prims[i];
+            prim.bb = TriangleBoundingBox(p1, p2, p3);
+            prim.center = (p1 + p2 + p3) / 3.0f;
+            prim.idx = i;
+        }
+    });
+    if(prims.empty()) {
+        return;
+    }
+    if(settings.mode == BVHBuildSettings::SAH_SPATIAL) {
+        BuildNodesSpatial(this->nodes, prims, settings, mesh_triangles.data(), this->vertices.data());
+    }
+    else {
+        BuildNodes(this->nodes, prims, settings);
+    }
+
+    // store the triangles in leaf order so every leaf references a contiguous range
+    // unused lanes of the last block stay zero, which makes them degenerate and never hit
+    this->triangles.resize(prims.size());
+    this->triangle_blocks.resize((prims.size() + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE, TriangleBlock{});
+    ForEachBuildChunk(prims.size(), [&](uint32_t, uint32_t first, uint32_t chunk_size) {
+        for(uint32_t i = first; i < first + chunk_size; ++i) {
+            const Triangle& trig = mesh_triangles[prims[i].idx];
+            this->triangles[i] = trig;
+            SetTriangleBlockLane(this->triangle_blocks[i / TRIANGLE_BLOCK_SIZE], i % TRIANGLE_BLOCK_SIZE, this->vertices[trig.idx_1].pos, this->vertices[trig.idx_2].pos, this->vertices[trig.idx_3].pos);
+        }
+    });
+    this->build_sah_cost = this->GetSAHCost();
+    if(settings.mode == BVHBuildSettings::SAH_SPATIAL) {
+        // the leaves are clipped to their split planes but Refit can only fit them to whole triangles,
+        // so it is compared against the same tree with unclipped bounds
+        std::vector<BVHNode> clipped_nodes = this->nodes;
+        for(uint32_t i = this->nodes.size(); i-- > 0;) {
+            RefitNode(*this, i);
+        }
+        this->build_sah_cost = this->GetSAHCost();
+        this->nodes.swap(clipped_nodes);
+    }
+    this->CollapseToWide(settings.collapse_width, settings.quantize_bits);
+}
+
+template<uint32_t W>
+static void SetWideChild(WideBVHNode<W>& wide_node, uint32_t slot, const BoundingBox& bb, uint32_t child, uint32_t triangle_count) {
+    for(int axis = 0; axis < 3; ++axis) {
+        wide_node.bb_min[axis][slot] = bb.min[axis];
+        wide_node.bb_max[axis][slot] = bb.max[axis];
+    }
+    wide_node.child[slot] = child;
+    wide_node.triangle_count[slot] = triangle_count;
+}
+// turns the binary subtree below node_idx into wide nodes, returns the index of the new wide node
+template<uint32_t W>
+static uint32_t CollapseNode(const std::vector<BVHNode>& nodes, uint32_t node_idx, std::vector<WideBVHNode<W>>& wide_nodes) {
+    uint32_t children[W];
+    uint32_t child_count = 0;
+    if(nodes[node_idx].triangle_count != 0) {
+        // only happens for a root that is a leaf
+        children[child_count++] = node_idx;
+    }
+    else {
+        children[child_count++] = node_idx + 1;
+        children[child_count++] = nodes[node_idx].offset;
+    }
+    // keep opening the interior child with the largest surface area until the node is full
+    while(child_count < W) {
+        int best = -1;
+        float best_area = -1.0f;
+        for(uint32_t i = 0; i < child_count; ++i) {
+            const BVHNode& child = nodes[children[i]];
+            const float area = BoundingBoxSurfaceArea(child.bb);
+            if(child.triangle_count == 0 && area > best_area) {
+                best = i;
+                best_area = area;
+            }
+        }
+        if(best < 0) {
+            break;
+        }
+        const uint32_t opened = children[best];
+        children[best] = opened + 1;
+        children[child_count++] = nodes[opened].offset;
+    }
+
+    const uint32_t wide_idx = wide_nodes.size();
+    wide_nodes.push_back({});
+    wide_nodes[wide_idx].child_count = child_count;
+    for(uint32_t i = 0; i < W; ++i) {
+        if(i >= child_count) {
+            SetWideChild(wide_nodes[wide_idx], i, BoundingBox{}, 0, 0);
+            continue;
+        }
+        const BVHNode& child = nodes[children[i]];
+        if(child.triangle_count != 0) {
+            SetWideChild(wide_nodes[wide_idx], i, child.bb, child.offset, child.triangle_count);
+        }
+        else {
+            // wide_nodes may reallocate while recursing, so only index it afterwards
+            const uint32_t child_wide_idx = CollapseNode(nodes, children[i], wide_nodes);
+            SetWideChild(wide_nodes[wide_idx], i, child.bb, child_wide_idx, 0);
+        }
+    }
+    return wide_idx;
+}
+// stores node's child bounds relative to the box around all of them
+// every step is checked with the same float math the traversal decodes with, so rounding can only grow a box
+template<uint32_t W, typename Q>
+static void QuantizeWideNode(const WideBVHNode<W>& node, QuantizedBVHNode<W, Q>& out) {
+    constexpr uint32_t max_step = std::numeric_limits<Q>::max();
+    for(int axis = 0; axis < 3; ++axis) {
+        float lo = INFINITY;
+        float hi = -INFINITY;
+        for(uint32_t slot = 0; slot < node.child_count; ++slot) {
+            lo = glm::min(lo, node.bb_min[axis][slot]);
+            hi = glm::max(hi, node.bb_max[axis][slot]);
+        }
+        float scale = (hi - lo) / (float)max_step;
+        while(lo + (float)max_step * scale < hi) {
+            scale = std::nextafter(scale, INFINITY);
+        }
+        out.origin[axis] = lo;
+        out.scale[axis] = scale;
+        for(uint32_t slot = 0; slot < W; ++slot) {
+            if(slot >= node.child_count) {
+                out.q_min[axis][slot] = 0;
+                out.q_max[axis][slot] = 0;
+                continue;
+            }
+            const float child_min = node.bb_min[axis][slot];
+            const float child_max = node.bb_max[axis][slot];
+            uint32_t q_min = 0;
+            uint32_t q_max = max_step;
+            if(scale > 0.0f) {
+                q_min = (uint32_t)glm::clamp(std::floor((child_min - lo) / scale), 0.0f, (float)max_step);
+                q_max = (uint32_t)glm::clamp(std::ceil((child_max - lo) / scale), 0.0f, (float)max_step);
+            }
+            while(q_min > 0 && lo + (float)q_min * scale > child_min) {
+                q_min--;
+            }
+            while(q_max < max_step && lo + (float)q_max * scale < child_max) {
+                q_max++;
+            }
+            out.q_min[axis][slot] = (Q)q_min;
+            out.q_max[axis][slot] = (Q)q_max;
+        }
+    }
+    for(uint32_t slot = 0; slot < W; ++slot) {
+        out.child[slot] = node.child[slot];
+        out.triangle_count[slot] = node.triangle_count[slot];
+    }
+    out.child_count = node.child_count;
+}
+template<uint32_t W, typename Q>
+static void CollapseQuantized(const std::vector<BVHNode>& nodes, std::vector<QuantizedBVHNode<W, Q>>& quantized_nodes) {
+    // the float nodes are only needed until they are quantized, indices stay the same
+    std::vector<WideBVHNode<W>> wide_nodes;
+    wide_nodes.reserve(nodes.size() / (W / 2) + 1);
+    CollapseNode<W>(nodes, 0, wide_nodes);
+    quantized_nodes.resize(wide_nodes.size());
+    ForEachBuildChunk(wide_nodes.size(), [&](uint32_t, uint32_t first, uint32_t chunk_size) {
+        for(uint32_t i = first; i < first + chunk_size; ++i) {
+            QuantizeWideNode(wide_nodes[i], quantized_nodes[i]);
+        }
+    });
+}
+void BoundingVolumeHierarchy::CollapseToWide(uint32_t width, uint32_t quantize_bits) {
+    this->wide_nodes_4.clear();
+    this->wide_nodes_8.clear();
+    this->wide_nodes_4_q8.clear();
+    this->wide_nodes_4_q16.clear();
+    this->wide_nodes_8_q8.clear();
+    this->wide_nodes_8_q16.clear();
+    this->settings.collapse_width = width;
+    this->settings.quantize_bits = quantize_bits;
+    if(this->nodes.empty()) {
+        return;
+    }
+    if(width == 4 && quantize_bits == 8) {
+        CollapseQuantized<4>(this->nodes, this->wide_nodes_4_q8);
+    }
+    else if(width == 4 && quantize_bits == 16) {
+        CollapseQuantized<4>(this->nodes, this->wide_nodes_4_q16);
+    }
+    else if(width == 8 && quantize_bits == 8) {
+        CollapseQuantized<8>(this->nodes, this->wide_nodes_8_q8);
+    }
+    else if(width == 8 && quantize_bits == 16) {
+        CollapseQuantized<8>(this->nodes, this->wide_nodes_8_q16);
+    }
+    else if(width == 4) {
+        this->wide_nodes_4.reserve(this->nodes.size() / 2 + 1);
+        CollapseNode<4>(this->nodes, 0, this->wide_nodes_4);
+        this->wide_nodes_4.shrink_to_fit();
+    }
+    else if(width == 8) {
+        this->wide_nodes_8.reserve(this->nodes.size() / 4 + 1);
+        CollapseNode<8>(this->nodes, 0, this->wide_nodes_8);
+        this->wide_nodes_8.shrink_to_fit();
+    }
 }
 BoundingVolumeHierarchy::BoundingVolumeHierarchy(BoundingVolumeHierarchy&& o) {
-    this->root_node = o.root_node;
-    this->triangle_data = std::move(o.triangle_data);
+    this->nodes = std::move(o.nodes);
+    this->settings = o.settings;
+    this->build_sah_cost = o.build_sah_cost;
+    this->mesh_triangle_count = o.mesh_triangle_count;
+    this->wide_nodes_4 = std::move(o.wide_nodes_4);
+    this->wide_nodes_8 = std::move(o.wide_nodes_8);
+    this->wide_nodes_4_q8 = std::move(o.wide_nodes_4_q8);
+    this->wide_nodes_4_q16 = std::move(o.wide_nodes_4_q16);
+    this->wide_nodes_8_q8 = std::move(o.wide_nodes_8_q8);
+    this->wide_nodes_8_q16 = std::move(o.wide_nodes_8_q16);
+    this->triangle_blocks = std::move(o.triangle_blocks);
+    this->triangles = std::move(o.triangles);
+    this->vertices = std::move(o.vertices);
 }
 BoundingVolumeHierarchy& BoundingVolumeHierarchy::operator=(BoundingVolumeHierarchy&& o) {
-    this->Destroy();
-    this->root_node = o.root_node;
-    this->triangle_data = std::move(o.triangle_data);
+    this->nodes = std::move(o.nodes);
+    this->settings = o.settings;
+    this->build_sah_cost = o.build_sah_cost;
+    this->mesh_triangle_count = o.mesh_triangle_count;
+    this->wide_nodes_4 = std::move(o.wide_nodes_4);
+    this->wide_nodes_8 = std::move(o.wide_nodes_8);
+    this->wide_nodes_4_q8 = std::move(o.wide_nodes_4_q8);
+    this->wide_nodes_4_q16 = std::move(o.wide_nodes_4_q16);
+    this->wide_nodes_8_q8 = std::move(o.wide_nodes_8_q8);
+    this->wide_nodes_8_q16 = std::move(o.wide_nodes_8_q16);
+    this->triangle_blocks = std::move(o.triangle_blocks);
+    this->triangles = std::move(o.triangles);
+    this->vertices = std::move(o.vertices);
     return *this;
 }
-void BoundingVolumeHierarchy::Destroy() {
-    if(this->root_node.child_1) {
-        DestoryBoundingVolumeHierarchyNode(this->root_node.child_1);
-        delete this->root_node.child_1;
-        this->root_node.child_1 = nullptr;
+void BoundingVolumeHierarchy::Destroy() {
+    this->nodes.clear();
+    this->wide_nodes_4.clear();
+    this->wide_nodes_8.clear();
+    this->wide_nodes_4_q8.clear();
+    this->wide_nodes_4_q16.clear();
+    this->wide_nodes_8_q8.clear();
+    this->wide_nodes_8_q16.clear();
+    this->triangle_blocks.clear();
+    this->triangles.clear();
+    this->vertices.clear();
+    this->build_sah_cost = 0.0f;
+    this->mesh_triangle_count = 0;
+}
+float BoundingVolumeHierarchy::GetSAHCost() const {
+    if(this->nodes.empty()) {
+        return 0.0f;
+    }
+    double cost = 0.0;
+    for(const BVHNode& node : this->nodes) {
+        const float area = BoundingBoxSurfaceArea(node.bb);
+        if(node.triangle_count == 0) {
+            cost += this->settings.traversal_cost * area;
+        }
+        else {
+            cost += this->settings.intersection_cost * area * node.triangle_count;
+        }
+    }
+    return (float)(cost / glm::max(BoundingBoxSurfaceArea(this->nodes[0].bb), 1e-20f));
+}
+BVHQualityReport BoundingVolumeHierarchy::Analyze() const {
+    BVHQualityReport report;
+    report.node_bytes = this->nodes.size() * sizeof(BVHNode);
+    report.wide_node_bytes = this->wide_nodes_4.size() * sizeof(BVH4Node) + this->wide_nodes_8.size() * sizeof(BVH8Node) +
+                             this->wide_nodes_4_q8.size() * sizeof(BVH4NodeQ8) + this->wide_nodes_4_q16.size() * sizeof(BVH4NodeQ16) +
+                             this->wide_nodes_8_q8.size() * sizeof(BVH8NodeQ8) + this->wide_nodes_8_q16.size() * sizeof(BVH8NodeQ16);
+    report.triangle_bytes = this->triangle_blocks.size() * sizeof(TriangleBlock) + this->triangles.size() * sizeof(Triangle);
+    report.vertex_bytes = this->vertices.size() * sizeof(Vertex);
+    report.total_bytes = report.node_bytes + report.wide_node_bytes + report.triangle_bytes + report.vertex_bytes;
+    if(this->nodes.empty()) {
+        return report;
+    }
+    report.sah_cost = this->GetSAHCost();
+
+    const float root_volume = BoundingBoxVolume(this->nodes[0].bb);
+    const float root_area = BoundingBoxSurfaceArea(this->nodes[0].bb);
+    double overlap_volume = 0.0;
+    double overlap_area = 0.0;
+    uint64_t leaf_depth_sum = 0;
+    // the tree is depth first, so the first child of an interior node is always the next node
+    std::vector<std::pair<uint32_t, uint32_t>> stack = {{0, 0}};
+    while(!stack.empty()) {
+        const uint32_t idx = stack.back().first;
+        const uint32_t depth = stack.back().second;
+        stack.pop_back();
+        const BVHNode& node = this->nodes[idx];
+        report.max_depth = glm::max(report.max_depth, depth);
+        if(node.triangle_count > 0) {
+            report.leaf_count++;
+            report.triangle_references += node.triangle_count;
+            leaf_depth_sum += depth;
+            if(report.leaf_depths.size() <= depth) {
+                report.leaf_depths.resize(depth + 1, 0);
+            }
+            report.leaf_depths[depth]++;
+            if(report.leaf_sizes.size() <= node.triangle_count) {
+                report.leaf_sizes.resize(node.triangle_count + 1, 0);
+            }
+            report.leaf_sizes[node.triangle_count]++;
+            continue;
+        }
+        report.interior_count++;
+        const BoundingBox overlap = IntersectBoundingBox(this->nodes[idx + 1].bb, this->nodes[node.offset].bb);
+        overlap_volume += BoundingBoxVolume(overlap);
+        overlap_area += BoundingBoxSurfaceArea(overlap);
+        stack.push_back({node.offset, depth + 1});
+        stack.push_back({idx + 1, depth + 1});
+    }
+    report.sibling_overlap_volume = root_volume > 0.0f ? (float)(overlap_volume / root_volume) : 0.0f;
+    report.sibling_overlap_area = root_area > 0.0f ? (float)(overlap_area / root_area) : 0.0f;
+    report.average_leaf_depth = report.leaf_count ? (float)((double)leaf_depth_sum / report.leaf_count) : 0.0f;
+    return report;
+}
+std::string BVHQualityReport::ToJson() const {
+    nlohmann::json report;
+    report["sah_cost"] = this->sah_cost;
+    report["sibling_overlap_volume"] = this->sibling_overlap_volume;
+    report["sibling_overlap_area"] = this->sibling_overlap_area;
+    report["interior_count"] = this->interior_count;
+    report["leaf_count"] = this->leaf_count;
+    report["max_depth"] = this->max_depth;
+    report["average_leaf_depth"] = this->average_leaf_depth;
+    report["leaf_depths"] = this->leaf_depths;
+    report["leaf_sizes"] = this->leaf_sizes;
+    report["triangle_references"] = this->triangle_references;
+    report["memory"]["nodes"] = this->node_bytes;
+    report["memory"]["wide_nodes"] = this->wide_node_bytes;
+    report["memory"]["triangles"] = this->triangle_bytes;
+    report["memory"]["vertices"] = this->vertex_bytes;
+    report["memory"]["total"] = this->total_bytes;
+    return report.dump(2);
+}
+
+// layout of a cache file: header, then every array at a BVH_CACHE_ALIGNMENT aligned offset
+// the arrays are stored exactly as they are in memory, loading is a bounds check and a copy per array
+static constexpr char BVH_CACHE_MAGIC[8] = {'B', 'V', 'H', 'C', 'A', 'C', 'H', 'E'};
+static constexpr uint64_t BVH_CACHE_ALIGNMENT = 64;
+enum BVHCacheSection {
+    BVH_CACHE_NODES,
+    BVH_CACHE_WIDE_NODES_4,
+    BVH_CACHE_WIDE_NODES_8,
+    BVH_CACHE_WIDE_NODES_4_Q8,
+    BVH_CACHE_WIDE_NODES_4_Q16,
+    BVH_CACHE_WIDE_NODES_8_Q8,
+    BVH_CACHE_WIDE_NODES_8_Q16,
+    BVH_CACHE_TRIANGLE_BLOCKS,
+    BVH_CACHE_TRIANGLES,
+    BVH_CACHE_VERTICES,
+    BVH_CACHE_SECTION_COUNT,
+};
+struct BVHCacheHeader {
+    struct Section {
+        uint64_t offset;
+        uint64_t count;
+        // catches layout changes that forgot to bump CACHE_VERSION
+        uint64_t element_size;
+    };
+    char magic[8];
+    uint32_t version;
+    uint32_t triangle_block_size;
+    uint64_t key;
+    uint64_t file_size;
+    BVHBuildSettings settings;
+    float build_sah_cost;
+    uint32_t mesh_triangle_count;
+    Section sections[BVH_CACHE_SECTION_COUNT];
+};
+
+// 64 bit multiply-xorshift hash, a few GB/s so hashing the mesh stays cheap next to the build
+static uint64_t HashMix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+static uint64_t HashBytes(uint64_t h, const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        h = (h ^ HashMix(word)) * 0x9e3779b97f4a7c15ull;
+    }
+    uint64_t tail = size;
+    memcpy(&tail, bytes + i, size - i);
+    return HashMix(h ^ HashMix(tail ^ (uint64_t)size << 56));
+}
+template<typename T>
+static uint64_t HashValue(uint64_t h, const T& value) {
+    return HashBytes(h, &value, sizeof(T));
+}
+uint64_t BoundingVolumeHierarchy::ComputeCacheKey(const Mesh* mesh, const BVHBuildSettings& settings) {
+    // the vertices are hashed whole since the cache stores them for shading as well
+    uint64_t h = HashValue(0, CACHE_VERSION);
+    h = HashValue(h, mesh->vertex_count);
+    h = HashValue(h, mesh->triangle_count);
+    h = HashBytes(h, mesh->verts, sizeof(Vertex) * mesh->vertex_count);
+    if(mesh->inds) {
+        h = HashBytes(h, mesh->inds, sizeof(uint32_t) * 3 * mesh->triangle_count);
+    }
+    // field by field so padding never leaks into the key
+    h = HashValue(h, (uint32_t)settings.mode);
+    h = HashValue(h, settings.max_depth);
+    h = HashValue(h, settings.min_leaf_size);
+    h = HashValue(h, settings.max_leaf_size);
+    h = HashValue(h, settings.bin_count);
+    h = HashValue(h, settings.traversal_cost);
+    h = HashValue(h, settings.intersection_cost);
+    h = HashValue(h, settings.collapse_width);
+    h = HashValue(h, settings.quantize_bits);
+    h = HashValue(h, settings.spatial_split_budget);
+    h = HashValue(h, settings.spatial_split_alpha);
+    return h;
+}
+bool BoundingVolumeHierarchy::SaveToFile(const char* filename, uint64_t key) const {
+    BVHCacheHeader header = {};
+    memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.triangle_block_size = TRIANGLE_BLOCK_SIZE;
+    header.key = key;
+    header.settings = this->settings;
+    header.build_sah_cost = this->build_sah_cost;
+    header.mesh_triangle_count = this->mesh_triangle_count;
+    const void* section_data[BVH_CACHE_SECTION_COUNT] = {
+        this->nodes.data(), this->wide_nodes_4.data(), this->wide_nodes_8.data(),
+        this->wide_nodes_4_q8.data(), this->wide_nodes_4_q16.data(), this->wide_nodes_8_q8.data(), this->wide_nodes_8_q16.data(),
+        this->triangle_blocks.data(), this->triangles.data(), this->vertices.data(),
+    };
+    const size_t section_counts[BVH_CACHE_SECTION_COUNT] = {
+        this->nodes.size(), this->wide_nodes_4.size(), this->wide_nodes_8.size(),
+        this->wide_nodes_4_q8.size(), this->wide_nodes_4_q16.size(), this->wide_nodes_8_q8.size(), this->wide_nodes_8_q16.size(),
+        this->triangle_blocks.size(), this->triangles.size(), this->vertices.size(),
+    };
+    const size_t element_sizes[BVH_CACHE_SECTION_COUNT] = {
+        sizeof(BVHNode), sizeof(BVH4Node), sizeof(BVH8Node),
+        sizeof(BVH4NodeQ8), sizeof(BVH4NodeQ16), sizeof(BVH8NodeQ8), sizeof(BVH8NodeQ16),
+        sizeof(TriangleBlock), sizeof(Triangle), sizeof(Vertex),
+    };
+    uint64_t offset = sizeof(BVHCacheHeader);
+    for(uint32_t i = 0; i < BVH_CACHE_SECTION_COUNT; ++i) {
+        offset = (offset + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT * BVH_CACHE_ALIGNMENT;
+        header.sections[i].offset = offset;
+        header.sections[i].count = section_counts[i];
+        header.sections[i].element_size = element_sizes[i];
+        offset += section_counts[i] * element_sizes[i];
+    }
+    header.file_size = offset;
+
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if(!file.is_open()) {
+        return false;
+    }
+    static const char padding[BVH_CACHE_ALIGNMENT] = {};
+    file.write((const char*)&header, sizeof(header));
+    uint64_t written = sizeof(header);
+    for(uint32_t i = 0; i < BVH_CACHE_SECTION_COUNT; ++i) {
+        file.write(padding, header.sections[i].offset - written);
+        file.write((const char*)section_data[i], section_counts[i] * element_sizes[i]);
+        written = header.sections[i].offset + section_counts[i] * element_sizes[i];
+    }
+    return file.good();
+}
+template<typename T>
+static bool ReadCacheSection(const MappedFile& file, const BVHCacheHeader::Section& section, std::vector<T>& out) {
+    if(section.element_size != sizeof(T) || section.offset > file.size || section.count > (file.size - section.offset) / sizeof(T)) {
+        return false;
+    }
+    const T* first = (const T*)((const char*)file.data + section.offset);
+    out.assign(first, first + section.count);
+    return true;
+}
+// a cache file can be damaged without its header noticing, and traversal trusts every index it finds
+// these make sure all of them stay inside the arrays they point into and the tree fits the traversal stacks
+// children always come after their parent, so one pass in order tracks the depth of every node
+static bool ValidateBinaryNodes(const std::vector<BVHNode>& nodes, size_t triangle_count) {
+    std::vector<uint8_t> depth(nodes.size(), 0);
+    for(size_t i = 0; i < nodes.size(); ++i) {
+        const BVHNode& node = nodes[i];
+        if(node.triangle_count != 0) {
+            if((uint64_t)node.offset + node.triangle_count > triangle_count) {
+                return false;
+            }
+            continue;
+        }
+        if(node.offset <= i + 1 || node.offset >= nodes.size() || depth[i] > BoundingVolumeHierarchy::MAX_DEPTH) {
+            return false;
+        }
+        depth[i + 1] = glm::max(depth[i + 1], (uint8_t)(depth[i] + 1));
+        depth[node.offset] = glm::max(depth[node.offset], (uint8_t)(depth[i] + 1));
+    }
+    return true;
+}
+template<typename Node>
+static bool ValidateWideNodes(const std::vector<Node>& nodes, size_t triangle_count) {
+    std::vector<uint8_t> depth(nodes.size(), 0);
+    for(size_t i = 0; i < nodes.size(); ++i) {
+        const Node& node = nodes[i];
+        if(node.child_count > Node::WIDTH) {
+            return false;
+        }
+        for(uint32_t slot = 0; slot < node.child_count; ++slot) {
+            const uint32_t child = node.child[slot];
+            if(node.triangle_count[slot] != 0) {
+                if((uint64_t)child + node.triangle_count[slot] > triangle_count) {
+                    return false;
+                }
+                continue;
+            }
+            if(child <= i || child >= nodes.size() || depth[i] > BoundingVolumeHierarchy::MAX_DEPTH) {
+                return false;
+            }
+            depth[child] = glm::max(depth[child], (uint8_t)(depth[i] + 1));
+        }
+    }
+    return true;
+}
+static bool ValidateCachedBVH(const BoundingVolumeHierarchy& bvh) {
+    const size_t block_count = (bvh.triangles.size() + BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE - 1) / BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE;
+    if(bvh.triangle_blocks.size() != block_count) {
+        return false;
+    }
+    for(const BoundingVolumeHierarchy::Triangle& trig : bvh.triangles) {
+        if(trig.idx_1 >= bvh.vertices.size() || trig.idx_2 >= bvh.vertices.size() || trig.idx_3 >= bvh.vertices.size()) {
+            return false;
+        }
+    }
+    const size_t triangle_count = bvh.triangles.size();
+    return ValidateBinaryNodes(bvh.nodes, triangle_count) &&
+           ValidateWideNodes(bvh.wide_nodes_4, triangle_count) && ValidateWideNodes(bvh.wide_nodes_8, triangle_count) &&
+           ValidateWideNodes(bvh.wide_nodes_4_q8, triangle_count) && ValidateWideNodes(bvh.wide_nodes_4_q16, triangle_count) &&
+           ValidateWideNodes(bvh.wide_nodes_8_q8, triangle_count) && ValidateWideNodes(bvh.wide_nodes_8_q16, triangle_count);
+}
+bool BoundingVolumeHierarchy::LoadFromFile(const char* filename, uint64_t key) {
+    MappedFile file = OpenMappedFile(filename);
+    if(!file.data || file.size < sizeof(BVHCacheHeader)) {
+        return false;
+    }
+    BVHCacheHeader header;
+    memcpy(&header, file.data, sizeof(header));
+    if(memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != CACHE_VERSION || header.triangle_block_size != TRIANGLE_BLOCK_SIZE ||
+       header.key != key || header.file_size != file.size) {
+        return false;
+    }
+    BoundingVolumeHierarchy loaded;
+    bool valid = ReadCacheSection(file, header.sections[BVH_CACHE_NODES], loaded.nodes);
+    valid = valid && ReadCacheSection(file, header.sections[BVH_CACHE_WIDE_NODES_4], loaded.wide_nodes_4);
+    valid = valid && ReadCacheSection(file, header.sections[BVH_CACHE_WIDE_NODES_8], loaded.wide_nodes_8);
+    valid = valid && ReadCacheSection(file, header.sections[BVH_CACHE_WIDE_NODES_4_Q8], loaded.wide_nodes_4_q8);
+    valid = valid && ReadCacheSection(file, header.sections[BVH_CACHE_WIDE_NODES_4_Q16], loaded.wide_nodes_4_q16);
+    valid = valid && ReadCacheSection(file, header.sections[BVH_CACHE_WIDE_NODES_8_Q8], loaded.wide_nodes_8_q8);
+    valid = valid && ReadCacheSection(file, header.sections[BVH_CACHE_WIDE_NODES_8_Q16], loaded.wide_nodes_8_q16);
+    valid = valid && ReadCacheSection(file, header.sections[BVH_CACHE_TRIANGLE_BLOCKS], loaded.triangle_blocks);
+    valid = valid && ReadCacheSection(file, header.sections[BVH_CACHE_TRIANGLES], loaded.triangles);
+    valid = valid && ReadCacheSection(file, header.sections[BVH_CACHE_VERTICES], loaded.vertices);
+    valid = valid && ValidateCachedBVH(loaded);
+    if(!valid) {
+        return false;
+    }
+    loaded.settings = header.settings;
+    loaded.build_sah_cost = header.build_sah_cost;
+    loaded.mesh_triangle_count = header.mesh_triangle_count;
+    *this = std::move(loaded);
+    return true;
+}
+void BoundingVolumeHierarchy::CreateFromMeshCached(const Mesh* mesh, const BVHBuildSettings& settings, const char* cache_dir) {
+    const uint64_t key = ComputeCacheKey(mesh, settings);
+    char key_str[17];
+    snprintf(key_str, sizeof(key_str), "%016llx", (unsigned long long)key);
+    const std::filesystem::path path = std::filesystem::path(cache_dir) / (std::string(key_str) + ".bvh");
+    if(this->LoadFromFile(path.string().c_str(), key)) {
+        return;
+    }
+    this->CreateFromMesh(mesh, settings);
+    std::error_code err;
+    std::filesystem::create_directories(cache_dir, err);
+    if(!this->SaveToFile(path.string().c_str(), key)) {
+        std::cerr << "failed to write BVH cache " << path.string() << std::endl;
+    }
+}
+
+// cuts the depth first node array into subtrees of at most max_size nodes that can be refit independently
+// the subtree of node_idx covers [node_idx, end), the nodes above the cut go to top_nodes in depth first order
+static void CollectRefitSubtrees(const std::vector<BVHNode>& nodes, uint32_t node_idx, uint32_t end, uint32_t max_size, std::vector<std::pair<uint32_t, uint32_t>>& subtrees, std::vector<uint32_t>& top_nodes) {
+    if(end - node_idx <= max_size || nodes[node_idx].triangle_count != 0) {
+        subtrees.push_back({node_idx, end});
+        return;
+    }
+    top_nodes.push_back(node_idx);
+    CollectRefitSubtrees(nodes, node_idx + 1, nodes[node_idx].offset, max_size, subtrees, top_nodes);
+    CollectRefitSubtrees(nodes, nodes[node_idx].offset, end, max_size, subtrees, top_nodes);
+}
+template<uint32_t W>
+static void RefitWideNodes(const BoundingVolumeHierarchy& bvh, std::vector<WideBVHNode<W>>& wide_nodes) {
+    // leaf slots only depend on the triangles
+    ForEachBuildChunk(wide_nodes.size(), [&](uint32_t, uint32_t first, uint32_t chunk_size) {
+        for(uint32_t i = first; i < first + chunk_size; ++i) {
+            WideBVHNode<W>& node = wide_nodes[i];
+            for(uint32_t slot = 0; slot < node.child_count; ++slot) {
+                if(node.triangle_count[slot] != 0) {
+                    SetWideChild(node, slot, LeafBoundingBox(bvh, node.child[slot], node.triangle_count[slot]), node.child[slot], node.triangle_count[slot]);
+                }
+            }
+        }
+    });
+    // children are always stored after their parent, so walking backwards sees them first
+    for(size_t i = wide_nodes.size(); i-- > 0;) {
+        WideBVHNode<W>& node = wide_nodes[i];
+        for(uint32_t slot = 0; slot < node.child_count; ++slot) {
+            if(node.triangle_count[slot] != 0) {
+                continue;
+            }
+            const WideBVHNode<W>& child = wide_nodes[node.child[slot]];
+            BoundingBox bb = EmptyBoundingBox();
+            for(uint32_t child_slot = 0; child_slot < child.child_count; ++child_slot) {
+                ExpandBoundingBox(bb, glm::vec3(child.bb_min[0][child_slot], child.bb_min[1][child_slot], child.bb_min[2][child_slot]));
+                ExpandBoundingBox(bb, glm::vec3(child.bb_max[0][child_slot], child.bb_max[1][child_slot], child.bb_max[2][child_slot]));
+            }
+            SetWideChild(node, slot, bb, node.child[slot], 0);
+        }
+    }
+}
+float BoundingVolumeHierarchy::Refit(const Mesh* mesh) {
+    if(mesh->vertex_count != this->vertices.size() || mesh->triangle_count != this->mesh_triangle_count) {
+        this->CreateFromMesh(mesh, this->settings);
+        return 1.0f;
+    }
+    ForEachBuildChunk(mesh->vertex_count, [&](uint32_t, uint32_t first, uint32_t chunk_size) {
+        std::copy(mesh->verts + first, mesh->verts + first + chunk_size, this->vertices.begin() + first);
+    });
+    ForEachBuildChunk(this->triangles.size(), [&](uint32_t, uint32_t first, uint32_t chunk_size) {
+        for(uint32_t i = first; i < first + chunk_size; ++i) {
+            const Triangle& trig = this->triangles[i];
+            SetTriangleBlockLane(this->triangle_blocks[i / TRIANGLE_BLOCK_SIZE], i % TRIANGLE_BLOCK_SIZE, this->vertices[trig.idx_1].pos, this->vertices[trig.idx_2].pos, this->vertices[trig.idx_3].pos);
+        }
+    });
+    if(this->nodes.empty()) {
+        return 1.0f;
+    }
+
+    // every subtree is refit bottom up on its own, then the few nodes above them
+    std::vector<std::pair<uint32_t, uint32_t>> subtrees;
+    std::vector<uint32_t> top_nodes;
+    CollectRefitSubtrees(this->nodes, 0, this->nodes.size(), BVH_BUILD_PARALLEL_SIZE, subtrees, top_nodes);
+    GetThreadPool().ParallelFor(subtrees.size(), [&](uint32_t subtree_idx, uint32_t) {
+        for(uint32_t i = subtrees[subtree_idx].second; i-- > subtrees[subtree_idx].first;) {
+            RefitNode(*this, i);
+        }
+    });
+    for(size_t i = top_nodes.size(); i-- > 0;) {
+        RefitNode(*this, top_nodes[i]);
+    }
+    RefitWideNodes(*this, this->wide_nodes_4);
+    RefitWideNodes(*this, this->wide_nodes_8);
+    if(this->settings.quantize_bits != 0) {
+        // quantized bounds can't be grown in place, requantizing the refit tree is just as cheap
+        this->CollapseToWide(this->settings.collapse_width, this->settings.quantize_bits);
+    }
+
+    if(this->build_sah_cost <= 0.0f) {
+        return 1.0f;
+    }
+    return this->GetSAHCost() / this->build_sah_cost;
+}
+
+// RAY_STATS_ADD(counter, n) adds n to a RayTraceStats counter of the ray being traced on this thread
+// without RAYTRACER_STATS it expands to nothing, so the traversal pays nothing for it
+#if RAYTRACER_STATS
+// null while nobody collects stats
+static thread_local RayTraceStats* ray_stats = nullptr;
+// one entry per ray of the packet being traced, indexed like the packet rays
+static thread_local RayTraceStats* ray_packet_stats = nullptr;
+#define RAY_STATS_ADD(counter, n) do { if(ray_stats) { ray_stats->counter += (n); } } while(0)
+#else
+#define RAY_STATS_ADD(counter, n) ((void)0)
+#endif
+// everything traced on this thread while the scope lives is counted into stats (per ray) and packet_stats (per packet ray)
+struct RayStatsScope {
+#if RAYTRACER_STATS
+    RayStatsScope(RayTraceStats* stats, RayTraceStats* packet_stats = nullptr) : prev_stats(ray_stats), prev_packet_stats(ray_packet_stats) {
+        ray_stats = stats;
+        ray_packet_stats = packet_stats;
+    }
+    ~RayStatsScope() {
+        ray_stats = this->prev_stats;
+        ray_packet_stats = this->prev_packet_stats;
+    }
+    RayTraceStats* prev_stats;
+    RayTraceStats* prev_packet_stats;
+#else
+    RayStatsScope(RayTraceStats*, RayTraceStats* = nullptr) {}
+#endif
+    RayStatsScope(const RayStatsScope&) = delete;
+};
+
+using TriangleSimd = SimdFloat<BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE>;
+// ray data broadcast to every lane, set up once per ray
+struct RaySimd {
+    TriangleSimd origin[3];
+    TriangleSimd dir[3];
+};
+static RaySimd BroadcastRay(const Ray& ray) {
+    RaySimd res;
+    for(int axis = 0; axis < 3; ++axis) {
+        res.origin[axis] = TriangleSimd::Broadcast(ray.origin[axis]);
+        res.dir[axis] = TriangleSimd::Broadcast(ray.dir[axis]);
+    }
+    return res;
+}
+// the triangle test on SIMD lanes, same math as the scalar RayTriangleIntersection
+// lanes may hold different triangles (leaf blocks) or different rays (packets)
+// returns the mask of lanes that are hit closer than max_dist
+static uint32_t RayTriangleIntersection(const RaySimd& ray, const TriangleSimd v0[3], const TriangleSimd e1[3], const TriangleSimd e2[3], const TriangleSimd& max_dist, TriangleSimd& out_dst, TriangleSimd& out_u, TriangleSimd& out_v) {
+    // normal = cross(e1, e2)
+    const TriangleSimd nx = e1[1] * e2[2] - e1[2] * e2[1];
+    const TriangleSimd ny = e1[2] * e2[0] - e1[0] * e2[2];
+    const TriangleSimd nz = e1[0] * e2[1] - e1[1] * e2[0];
+    const TriangleSimd aox = ray.origin[0] - v0[0];
+    const TriangleSimd aoy = ray.origin[1] - v0[1];
+    const TriangleSimd aoz = ray.origin[2] - v0[2];
+    // dao = cross(ao, dir)
+    const TriangleSimd daox = aoy * ray.dir[2] - aoz * ray.dir[1];
+    const TriangleSimd daoy = aoz * ray.dir[0] - aox * ray.dir[2];
+    const TriangleSimd daoz = aox * ray.dir[1] - aoy * ray.dir[0];
+
+    const TriangleSimd zero = TriangleSimd::Broadcast(0.0f);
+    const TriangleSimd determinant = zero - (ray.dir[0] * nx + ray.dir[1] * ny + ray.dir[2] * nz);
+    const TriangleSimd inv_det = TriangleSimd::Broadcast(1.0f) / determinant;
+    out_dst = (aox * nx + aoy * ny + aoz * nz) * inv_det;
+    out_u = (e2[0] * daox + e2[1] * daoy + e2[2] * daoz) * inv_det;
+    out_v = zero - (e1[0] * daox + e1[1] * daoy + e1[2] * daoz) * inv_det;
+    const TriangleSimd w = TriangleSimd::Broadcast(1.0f) - out_u - out_v;
+    return (determinant >= TriangleSimd::Broadcast(1e-8f)) & (out_dst >= zero) & (out_dst < max_dist) & (out_u >= zero) & (out_v >= zero) & (w >= zero);
+}
+// intersects a whole block at once
+static uint32_t RayTriangleBlockIntersection(const RaySimd& ray, const BoundingVolumeHierarchy::TriangleBlock& block, float max_dist, TriangleSimd& out_dst, TriangleSimd& out_u, TriangleSimd& out_v) {
+    TriangleSimd v0[3], e1[3], e2[3];
+    for(int axis = 0; axis < 3; ++axis) {
+        v0[axis] = TriangleSimd::Load(block.v0[axis]);
+        e1[axis] = TriangleSimd::Load(block.e1[axis]);
+        e2[axis] = TriangleSimd::Load(block.e2[axis]);
+    }
+    return RayTriangleIntersection(ray, v0, e1, e2, TriangleSimd::Broadcast(max_dist), out_dst, out_u, out_v);
+}
+// lanes of block_idx that lie inside [first, end)
+static uint32_t TriangleBlockLaneMask(uint32_t block_idx, uint32_t first, uint32_t end) {
+    const uint32_t block_start = block_idx * BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE;
+    const uint32_t lo = first > block_start ? first - block_start : 0;
+    const uint32_t hi = glm::min(end - block_start, BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE);
+    return ((1u << hi) - 1u) & ~((1u << lo) - 1u);
+}
+// tests the leaf triangles [first, first + count) a block at a time, updates hit with the closest one
+static void RayLeafIntersection(const RaySimd& ray, const BoundingVolumeHierarchy& bvh, uint32_t first, uint32_t count, RayTriangleHit& hit) {
+    RAY_STATS_ADD(triangle_tests, count);
+    const uint32_t end = first + count;
+    for(uint32_t block_idx = first / BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE; block_idx * BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE < end; ++block_idx) {
+        TriangleSimd dst, u, v;
+        uint32_t mask = RayTriangleBlockIntersection(ray, bvh.triangle_blocks[block_idx], hit.length, dst, u, v);
+        mask &= TriangleBlockLaneMask(block_idx, first, end);
+        while(mask) {
+            const uint32_t lane = SimdFirstBit(mask);
+            mask &= mask - 1;
+            if(dst[lane] < hit.length) {
+                hit.length = dst[lane];
+                hit.u = u[lane];
+                hit.v = v[lane];
+                hit.trig_idx = block_idx * BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE + lane;
+            }
+        }
+    }
+}
+static bool RayLeafOccluded(const RaySimd& ray, const BoundingVolumeHierarchy& bvh, uint32_t first, uint32_t count, float max_dist) {
+    RAY_STATS_ADD(triangle_tests, count);
+    const uint32_t end = first + count;
+    for(uint32_t block_idx = first / BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE; block_idx * BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE < end; ++block_idx) {
+        TriangleSimd dst, u, v;
+        const uint32_t mask = RayTriangleBlockIntersection(ray, bvh.triangle_blocks[block_idx], max_dist, dst, u, v);
+        if(mask & TriangleBlockLaneMask(block_idx, first, end)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// tests the ray against all W child boxes of a wide node
+// returns the mask of children entered before max_dist, out_dist holds the entry distances
+template<uint32_t W>
+static uint32_t RayWideBoundingBoxTest(const SimdFloat<W> origin[3], const SimdFloat<W> inv_dir[3], const SimdFloat<W> bb_min[3], const SimdFloat<W> bb_max[3], uint32_t child_count, float max_dist, SimdFloat<W>& out_dist) {
+    SimdFloat<W> tmin = SimdFloat<W>::Broadcast(0.0f);
+    SimdFloat<W> tmax = SimdFloat<W>::Broadcast(INFINITY);
+    for(int axis = 0; axis < 3; ++axis) {
+        const SimdFloat<W> t0 = (bb_min[axis] - origin[axis]) * inv_dir[axis];
+        const SimdFloat<W> t1 = (bb_max[axis] - origin[axis]) * inv_dir[axis];
+        if(axis == 0) {
+            tmin = Min(t0, t1);
+            tmax = Max(t0, t1);
+        }
+        else {
+            tmin = Max(tmin, Min(t0, t1));
+            tmax = Min(tmax, Max(t0, t1));
+        }
+    }
+    out_dist = tmin;
+    const uint32_t used = (1u << child_count) - 1u;
+    return (tmin <= tmax) & (SimdFloat<W>::Broadcast(0.0f) <= tmax) & (tmin <= SimdFloat<W>::Broadcast(max_dist)) & used;
+}
+template<uint32_t W>
+static uint32_t RayWideBoundingBoxTest(const SimdFloat<W> origin[3], const SimdFloat<W> inv_dir[3], const WideBVHNode<W>& node, float max_dist, SimdFloat<W>& out_dist) {
+    SimdFloat<W> bb_min[3];
+    SimdFloat<W> bb_max[3];
+    for(int axis = 0; axis < 3; ++axis) {
+        bb_min[axis] = SimdFloat<W>::Load(node.bb_min[axis]);
+        bb_max[axis] = SimdFloat<W>::Load(node.bb_max[axis]);
+    }
+    return RayWideBoundingBoxTest<W>(origin, inv_dir, bb_min, bb_max, node.child_count, max_dist, out_dist);
+}
+// decodes the child boxes on the fly, same math as QuantizeWideNode checked its rounding with
+template<uint32_t W, typename Q>
+static uint32_t RayWideBoundingBoxTest(const SimdFloat<W> origin[3], const SimdFloat<W> inv_dir[3], const QuantizedBVHNode<W, Q>& node, float max_dist, SimdFloat<W>& out_dist) {
+    SimdFloat<W> bb_min[3];
+    SimdFloat<W> bb_max[3];
+    for(int axis = 0; axis < 3; ++axis) {
+        const SimdFloat<W> node_origin = SimdFloat<W>::Broadcast(node.origin[axis]);
+        const SimdFloat<W> node_scale = SimdFloat<W>::Broadcast(node.scale[axis]);
+        bb_min[axis] = node_origin + SimdFloat<W>::LoadUnsigned(node.q_min[axis]) * node_scale;
+        bb_max[axis] = node_origin + SimdFloat<W>::LoadUnsigned(node.q_max[axis]) * node_scale;
+    }
+    return RayWideBoundingBoxTest<W>(origin, inv_dir, bb_min, bb_max, node.child_count, max_dist, out_dist);
+}
+
+static RayTriangleHit RayBinaryBVHTest(const Ray& ray, const BoundingVolumeHierarchy& bvh, float max_dist) {
+    struct StackEntry {
+        uint32_t node_idx;
+        float dist;
+    };
+    RayTriangleHit hit_result = EmptyTriangleHit(max_dist);
+    const glm::vec3 inv_dir = 1.0f / ray.dir;
+    RAY_STATS_ADD(box_tests, 1);
+    if(RayBoundingBoxIntersectionTest(ray.origin, inv_dir, bvh.nodes[0].bb, max_dist) == INFINITY) {
+        return hit_result;
+    }
+    const RaySimd ray_simd = BroadcastRay(ray);
+    StackEntry node_stack[BoundingVolumeHierarchy::MAX_STACK_SIZE];
+    uint32_t stack_size = 0;
+    uint32_t cur_node_idx = 0;
+    while(true) {
+        const BVHNode& cur_node = bvh.nodes[cur_node_idx];
+        if(cur_node.triangle_count == 0) {
+            RAY_STATS_ADD(node_visits, 1);
+            RAY_STATS_ADD(box_tests, 2);
+            uint32_t child_1 = cur_node_idx + 1;
+            uint32_t child_2 = cur_node.offset;
+            float dist1 = RayBoundingBoxIntersectionTest(ray.origin, inv_dir, bvh.nodes[child_1].bb, hit_result.length);
+            float dist2 = RayBoundingBoxIntersectionTest(ray.origin, inv_dir, bvh.nodes[child_2].bb, hit_result.length);
+            // always descend into the closer child first
+            if(dist2 < dist1) {
+                std::swap(child_1, child_2);
+                std::swap(dist1, dist2);
+            }
+            if(dist1 != INFINITY) {
+                if(dist2 != INFINITY) {
+                    node_stack[stack_size++] = {child_2, dist2};
+                }
+                cur_node_idx = child_1;
+                continue;
+            }
+        }
+        else {
+            RayLeafIntersection(ray_simd, bvh, cur_node.offset, cur_node.triangle_count, hit_result);
+        }
+        // pop the next node, skipping everything that starts behind the closest hit so far
+        bool found = false;
+        while(stack_size > 0) {
+            const StackEntry& entry = node_stack[--stack_size];
+            if(entry.dist <= hit_result.length) {
+                cur_node_idx = entry.node_idx;
+                found = true;
+                break;
+            }
+        }
+        if(!found) {
+            break;
+        }
+    }
+    return hit_result;
+}
+// Node is any of the float or quantized wide node types
+template<typename Node>
+static RayTriangleHit RayWideBVHTest(const Ray& ray, const BoundingVolumeHierarchy& bvh, const std::vector<Node>& wide_nodes, float max_dist) {
+    constexpr uint32_t W = Node::WIDTH;
+    struct StackEntry {
+        // node index for interior children, first triangle for leaves
+        uint32_t child;
+        uint32_t triangle_count;
+        float dist;
+    };
+    RayTriangleHit hit_result = EmptyTriangleHit(max_dist);
+    const RaySimd ray_simd = BroadcastRay(ray);
+    SimdFloat<W> origin[3];
+    SimdFloat<W> inv_dir[3];
+    for(int axis = 0; axis < 3; ++axis) {
+        origin[axis] = SimdFloat<W>::Broadcast(ray.origin[axis]);
+        inv_dir[axis] = SimdFloat<W>::Broadcast(1.0f / ray.dir[axis]);
+    }
+    // every visited node pushes at most W - 1 more entries than it pops
+    StackEntry node_stack[(W - 1) * (BoundingVolumeHierarchy::MAX_DEPTH + 1) + 1];
+    uint32_t stack_size = 0;
+    node_stack[stack_size++] = {0, 0, 0.0f};
+    while(stack_size > 0) {
+        const StackEntry entry = node_stack[--stack_size];
+        if(entry.dist > hit_result.length) {
+            continue;
+        }
+        if(entry.triangle_count != 0) {
+            RayLeafIntersection(ray_simd, bvh, entry.child, entry.triangle_count, hit_result);
+            continue;
+        }
+        const Node& node = wide_nodes[entry.child];
+        RAY_STATS_ADD(node_visits, 1);
+        RAY_STATS_ADD(box_tests, node.child_count);
+        SimdFloat<W> dist;
+        uint32_t mask = RayWideBoundingBoxTest(origin, inv_dir, node, hit_result.length, dist);
+        if(!mask) {
+            continue;
+        }
+        float dists[W];
+        dist.Store(dists);
+        // sort the hit children far to near so the nearest one is popped first
+        uint32_t order[W];
+        uint32_t hit_count = 0;
+        while(mask) {
+            const uint32_t slot = SimdFirstBit(mask);
+            mask &= mask - 1;
+            uint32_t k = hit_count++;
+            while(k > 0 && dists[order[k - 1]] < dists[slot]) {
+                order[k] = order[k - 1];
+                k--;
+            }
+            order[k] = slot;
+        }
+        for(uint32_t k = 0; k < hit_count; ++k) {
+            const uint32_t slot = order[k];
+            node_stack[stack_size++] = {node.child[slot], node.triangle_count[slot], dists[slot]};
+        }
+    }
+    return hit_result;
+}
+// uses the wide nodes if the BVH was collapsed, the binary tree otherwise
+static RayTriangleHit RayBoundingVolumeHierarchyTest(const Ray& ray, const BoundingVolumeHierarchy& bvh, float max_dist = INFINITY) {
+    RayTriangleHit hit_result = EmptyTriangleHit(max_dist);
+    if(!bvh.wide_nodes_8.empty()) {
+        hit_result = RayWideBVHTest(ray, bvh, bvh.wide_nodes_8, max_dist);
+    }
+    else if(!bvh.wide_nodes_4.empty()) {
+        hit_result = RayWideBVHTest(ray, bvh, bvh.wide_nodes_4, max_dist);
+    }
+    else if(!bvh.wide_nodes_8_q8.empty()) {
+        hit_result = RayWideBVHTest(ray, bvh, bvh.wide_nodes_8_q8, max_dist);
+    }
+    else if(!bvh.wide_nodes_8_q16.empty()) {
+        hit_result = RayWideBVHTest(ray, bvh, bvh.wide_nodes_8_q16, max_dist);
+    }
+    else if(!bvh.wide_nodes_4_q8.empty()) {
+        hit_result = RayWideBVHTest(ray, bvh, bvh.wide_nodes_4_q8, max_dist);
+    }
+    else if(!bvh.wide_nodes_4_q16.empty()) {
+        hit_result = RayWideBVHTest(ray, bvh, bvh.wide_nodes_4_q16, max_dist);
+    }
+    else if(!bvh.nodes.empty()) {
+        hit_result = RayBinaryBVHTest(ray, bvh, max_dist);
+    }
+    if(!hit_result.Hit()) {
+        hit_result.length = INFINITY;
+    }
+    return hit_result;
+}
+// any hit query for shadow/visibility rays, stops at the first triangle closer than max_dist
+static bool RayBinaryBVHOccluded(const Ray& ray, const BoundingVolumeHierarchy& bvh, float max_dist) {
+    const glm::vec3 inv_dir = 1.0f / ray.dir;
+    const RaySimd ray_simd = BroadcastRay(ray);
+    uint32_t node_stack[BoundingVolumeHierarchy::MAX_STACK_SIZE];
+    uint32_t stack_size = 0;
+    node_stack[stack_size++] = 0;
+    while(stack_size > 0) {
+        const uint32_t cur_node_idx = node_stack[--stack_size];
+        const BVHNode& cur_node = bvh.nodes[cur_node_idx];
+        RAY_STATS_ADD(box_tests, 1);
+        if(RayBoundingBoxIntersectionTest(ray.origin, inv_dir, cur_node.bb, max_dist) == INFINITY) {
+            continue;
+        }
+        if(cur_node.triangle_count == 0) {
+            RAY_STATS_ADD(node_visits, 1);
+            node_stack[stack_size++] = cur_node.offset;
+            node_stack[stack_size++] = cur_node_idx + 1;
+        }
+        else if(RayLeafOccluded(ray_simd, bvh, cur_node.offset, cur_node.triangle_count, max_dist)) {
+            return true;
+        }
+    }
+    return false;
+}
+template<typename Node>
+static bool RayWideBVHOccluded(const Ray& ray, const BoundingVolumeHierarchy& bvh, const std::vector<Node>& wide_nodes, float max_dist) {
+    constexpr uint32_t W = Node::WIDTH;
+    const RaySimd ray_simd = BroadcastRay(ray);
+    SimdFloat<W> origin[3];
+    SimdFloat<W> inv_dir[3];
+    for(int axis = 0; axis < 3; ++axis) {
+        origin[axis] = SimdFloat<W>::Broadcast(ray.origin[axis]);
+        inv_dir[axis] = SimdFloat<W>::Broadcast(1.0f / ray.dir[axis]);
+    }
+    uint32_t node_stack[(W - 1) * (BoundingVolumeHierarchy::MAX_DEPTH + 1) + 1];
+    uint32_t stack_size = 0;
+    node_stack[stack_size++] = 0;
+    while(stack_size > 0) {
+        const Node& node = wide_nodes[node_stack[--stack_size]];
+        RAY_STATS_ADD(node_visits, 1);
+        RAY_STATS_ADD(box_tests, node.child_count);
+        SimdFloat<W> dist;
+        uint32_t mask = RayWideBoundingBoxTest(origin, inv_dir, node, max_dist, dist);
+        while(mask) {
+            const uint32_t slot = SimdFirstBit(mask);
+            mask &= mask - 1;
+            if(node.triangle_count[slot] == 0) {
+                node_stack[stack_size++] = node.child[slot];
+            }
+            else if(RayLeafOccluded(ray_simd, bvh, node.child[slot], node.triangle_count[slot], max_dist)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+static bool RayBoundingVolumeHierarchyOccluded(const Ray& ray, const BoundingVolumeHierarchy& bvh, float max_dist) {
+    if(!bvh.wide_nodes_8.empty()) {
+        return RayWideBVHOccluded(ray, bvh, bvh.wide_nodes_8, max_dist);
+    }
+    else if(!bvh.wide_nodes_4.empty()) {
+        return RayWideBVHOccluded(ray, bvh, bvh.wide_nodes_4, max_dist);
+    }
+    else if(!bvh.wide_nodes_8_q8.empty()) {
+        return RayWideBVHOccluded(ray, bvh, bvh.wide_nodes_8_q8, max_dist);
+    }
+    else if(!bvh.wide_nodes_8_q16.empty()) {
+        return RayWideBVHOccluded(ray, bvh, bvh.wide_nodes_8_q16, max_dist);
+    }
+    else if(!bvh.wide_nodes_4_q8.empty()) {
+        return RayWideBVHOccluded(ray, bvh, bvh.wide_nodes_4_q8, max_dist);
+    }
+    else if(!bvh.wide_nodes_4_q16.empty()) {
+        return RayWideBVHOccluded(ray, bvh, bvh.wide_nodes_4_q16, max_dist);
+    }
+    else if(!bvh.nodes.empty()) {
+        return RayBinaryBVHOccluded(ray, bvh, max_dist);
+    }
+    return false;
+}
+
+// camera rays of one 8x8 pixel block, traced together so every BVH node is
+// fetched once for the whole packet instead of once per ray
+static constexpr uint32_t RAY_PACKET_DIM = 8;
+static constexpr uint32_t RAY_PACKET_SIZE = RAY_PACKET_DIM * RAY_PACKET_DIM;
+static constexpr uint32_t RAY_PACKET_LANES = BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE;
+static_assert(RAY_PACKET_SIZE % RAY_PACKET_LANES == 0, "packets have to be made of whole SIMD chunks");
+struct RayPacket {
+    float origin[3][RAY_PACKET_SIZE];
+    float dir[3][RAY_PACKET_SIZE];
+    float inv_dir[3][RAY_PACKET_SIZE];
+    uint32_t count;
+};
+static void SetPacketRay(RayPacket& packet, uint32_t idx, const Ray& ray) {
+    for(int axis = 0; axis < 3; ++axis) {
+        packet.origin[axis][idx] = ray.origin[axis];
+        packet.dir[axis][idx] = ray.dir[axis];
+        packet.inv_dir[axis][idx] = 1.0f / ray.dir[axis];
+    }
+}
+static Ray GetPacketRay(const RayPacket& packet, uint32_t idx) {
+    Ray ray;
+    ray.origin = glm::vec3(packet.origin[0][idx], packet.origin[1][idx], packet.origin[2][idx]);
+    ray.dir = glm::vec3(packet.dir[0][idx], packet.dir[1][idx], packet.dir[2][idx]);
+    return ray;
+}
+// fills the unused lanes of the last chunk with copies of the first ray, their results are never used
+// but this keeps garbage (and slow denormals/NaNs) out of the SIMD math
+static void FinishPacket(RayPacket& packet) {
+    const Ray first = GetPacketRay(packet, 0);
+    for(uint32_t i = packet.count; i % RAY_PACKET_LANES != 0; ++i) {
+        SetPacketRay(packet, i, first);
+    }
+}
+static uint32_t PacketChunkCount(const RayPacket& packet) {
+    return (packet.count + RAY_PACKET_LANES - 1) / RAY_PACKET_LANES;
+}
+static RaySimd LoadPacketChunk(const RayPacket& packet, uint32_t chunk) {
+    RaySimd res;
+    for(int axis = 0; axis < 3; ++axis) {
+        res.origin[axis] = TriangleSimd::Load(packet.origin[axis] + chunk * RAY_PACKET_LANES);
+        res.dir[axis] = TriangleSimd::Load(packet.dir[axis] + chunk * RAY_PACKET_LANES);
+    }
+    return res;
+}
+// bit i set if ray i is still interested in a node
+using RayPacketMask = uint64_t;
+static_assert(RAY_PACKET_SIZE <= 64, "the packet mask has one bit per ray");
+static uint32_t PacketMaskCount(RayPacketMask mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    return (uint32_t)__popcnt64(mask);
+#else
+    return (uint32_t)__builtin_popcountll(mask);
+#endif
+}
+static RayPacketMask PacketAllRays(const RayPacket& packet) {
+    return packet.count == 64 ? ~(RayPacketMask)0 : ((RayPacketMask)1 << packet.count) - 1;
+}
+static uint32_t PacketFirstRay(RayPacketMask mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long idx;
+    _BitScanForward64(&idx, mask);
+    return (uint32_t)idx;
+#else
+    return (uint32_t)__builtin_ctzll(mask);
+#endif
+}
+#if RAYTRACER_STATS
+#define RAY_PACKET_STATS_ADD(counter, ray_mask, n) do { if(ray_packet_stats) { AddPacketStats(&RayTraceStats::counter, ray_mask, n); } } while(0)
+static void AddPacketStats(uint64_t RayTraceStats::* counter, RayPacketMask ray_mask, uint64_t n) {
+    while(ray_mask) {
+        ray_packet_stats[PacketFirstRay(ray_mask)].*counter += n;
+        ray_mask &= ray_mask - 1;
+    }
+}
+#else
+#define RAY_PACKET_STATS_ADD(counter, ray_mask, n) ((void)0)
+#endif
+// counters of one ray of the packet being traced
+static RayTraceStats* GetPacketRayStats(uint32_t ray_idx) {
+#if RAYTRACER_STATS
+    return ray_packet_stats ? &ray_packet_stats[ray_idx] : nullptr;
+#else
+    (void)ray_idx;
+    return nullptr;
+#endif
+}
+static uint32_t PacketChunkMask(RayPacketMask mask, uint32_t chunk) {
+    return (uint32_t)(mask >> (chunk * RAY_PACKET_LANES)) & ((1u << RAY_PACKET_LANES) - 1u);
+}
+// returns the rays out of active that enter bb before their own max_dist, out_dist is the closest entry distance
+static RayPacketMask RayPacketBoundingBoxTest(const RayPacket& packet, RayPacketMask active, const float* max_dist, const BoundingBox& bb, float& out_dist) {
+    TriangleSimd bb_min[3], bb_max[3];
+    for(int axis = 0; axis < 3; ++axis) {
+        bb_min[axis] = TriangleSimd::Broadcast(bb.min[axis]);
+        bb_max[axis] = TriangleSimd::Broadcast(bb.max[axis]);
+    }
+    const TriangleSimd zero = TriangleSimd::Broadcast(0.0f);
+    RAY_PACKET_STATS_ADD(box_tests, active, 1);
+    RayPacketMask res = 0;
+    out_dist = INFINITY;
+    const uint32_t chunk_count = PacketChunkCount(packet);
+    for(uint32_t chunk = 0; chunk < chunk_count; ++chunk) {
+        const uint32_t active_lanes = PacketChunkMask(active, chunk);
+        if(!active_lanes) {
+            continue;
+        }
+        const uint32_t first = chunk * RAY_PACKET_LANES;
+        TriangleSimd tmin, tmax;
+        for(int axis = 0; axis < 3; ++axis) {
+            const TriangleSimd origin = TriangleSimd::Load(packet.origin[axis] + first);
+            const TriangleSimd inv_dir = TriangleSimd::Load(packet.inv_dir[axis] + first);
+            const TriangleSimd t0 = (bb_min[axis] - origin) * inv_dir;
+            const TriangleSimd t1 = (bb_max[axis] - origin) * inv_dir;
+            if(axis == 0) {
+                tmin = Min(t0, t1);
+                tmax = Max(t0, t1);
+            }
+            else {
+                tmin = Max(tmin, Min(t0, t1));
+                tmax = Min(tmax, Max(t0, t1));
+            }
+        }
+        uint32_t mask = (tmin <= tmax) & (zero <= tmax) & (tmin <= TriangleSimd::Load(max_dist + first)) & active_lanes;
+        res |= (RayPacketMask)mask << first;
+        while(mask) {
+            const uint32_t lane = SimdFirstBit(mask);
+            mask &= mask - 1;
+            out_dist = glm::min(out_dist, glm::max(tmin[lane], 0.0f));
+        }
+    }
+    return res;
+}
+// shared near-first traversal of a binary node array for the whole packet
+// a node is entered as soon as one ray hits it, leaf_func(first, count, ray_mask) is called for every entered leaf
+// with the rays that reached it, max_dist holds the current closest hit of every ray and may shrink inside leaf_func
+template<typename F>
+static void RayPacketTraverse(const RayPacket& packet, const std::vector<BVHNode>& nodes, const float* max_dist, const F& leaf_func) {
+    struct StackEntry {
+        uint32_t node_idx;
+        // the rays that entered the parent, only those can enter the node
+        RayPacketMask parent_mask;
+    };
+    if(nodes.empty() || packet.count == 0) {
+        return;
+    }
+    float dist;
+    RayPacketMask cur_mask = RayPacketBoundingBoxTest(packet, PacketAllRays(packet), max_dist, nodes[0].bb, dist);
+    if(!cur_mask) {
+        return;
+    }
+    StackEntry node_stack[BoundingVolumeHierarchy::MAX_STACK_SIZE];
+    uint32_t stack_size = 0;
+    uint32_t cur_node_idx = 0;
+    while(true) {
+        const BVHNode& cur_node = nodes[cur_node_idx];
+        if(cur_node.triangle_count == 0) {
+            RAY_PACKET_STATS_ADD(node_visits, cur_mask, 1);
+            uint32_t child_1 = cur_node_idx + 1;
+            uint32_t child_2 = cur_node.offset;
+            float dist1, dist2;
+            RayPacketMask mask1 = RayPacketBoundingBoxTest(packet, cur_mask, max_dist, nodes[child_1].bb, dist1);
+            RayPacketMask mask2 = RayPacketBoundingBoxTest(packet, cur_mask, max_dist, nodes[child_2].bb, dist2);
+            if(mask1 && mask2) {
+                if(dist2 < dist1) {
+                    std::swap(child_1, child_2);
+                    std::swap(mask1, mask2);
+                }
+                node_stack[stack_size++] = {child_2, cur_mask};
+                cur_node_idx = child_1;
+                cur_mask = mask1;
+                continue;
+            }
+            if(mask1 || mask2) {
+                cur_node_idx = mask1 ? child_1 : child_2;
+                cur_mask = mask1 ? mask1 : mask2;
+                continue;
+            }
+        }
+        else {
+            leaf_func(cur_node.offset, cur_node.triangle_count, cur_mask);
+        }
+        // the rays may have found closer hits since a node was pushed, so test it again when popping
+        cur_mask = 0;
+        while(stack_size > 0 && !cur_mask) {
+            const StackEntry& entry = node_stack[--stack_size];
+            cur_node_idx = entry.node_idx;
+            cur_mask = RayPacketBoundingBoxTest(packet, entry.parent_mask, max_dist, nodes[cur_node_idx].bb, dist);
+        }
+        if(!cur_mask) {
+            break;
+        }
+    }
+}
+// tests the rays in ray_mask against the leaf triangles [first, first + count)
+static void RayPacketLeafIntersection(const RayPacket& packet, const BoundingVolumeHierarchy& bvh, uint32_t first, uint32_t count, RayPacketMask ray_mask, float* max_dist, RayTriangleHit* hits) {
+    const uint32_t chunk_count = PacketChunkCount(packet);
+    uint32_t active_chunks = 0;
+    for(uint32_t chunk = 0; chunk < chunk_count; ++chunk) {
+        active_chunks += PacketChunkMask(ray_mask, chunk) != 0;
     }
-    if(this->root_node.child_2) {
-        DestoryBoundingVolumeHierarchyNode(this->root_node.child_2);
-        delete this->root_node.child_2;
-        this->root_node.child_2 = nullptr;
+    const uint32_t block_count = (first + count - 1) / BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE - first / BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE + 1;
+    if(PacketMaskCount(ray_mask) * block_count < active_chunks * count) {
+        // the rays are too scattered to fill the lanes, test them one by one with a triangle block in the lanes instead
+        while(ray_mask) {
+            const uint32_t ray_idx = PacketFirstRay(ray_mask);
+            ray_mask &= ray_mask - 1;
+            RayStatsScope stats_scope(GetPacketRayStats(ray_idx));
+            RayLeafIntersection(BroadcastRay(GetPacketRay(packet, ray_idx)), bvh, first, count, hits[ray_idx]);
+            max_dist[ray_idx] = hits[ray_idx].length;
+        }
+        return;
     }
-}
-static RayHitResult RayBoundingVolumeHierarchyTest(const Ray& ray, const BoundingVolumeHierarchy& bvh) {
-    std::vector<const BVHNode*> node_stack;
-    RayHitResult hit_result = {};
-    hit_result.hit = false;
-    hit_result.length = INFINITY;
-    if(RayBoundingBoxIntersectionTest(ray, bvh.root_node.bb) != INFINITY) {
-        node_stack.push_back(&bvh.root_node);
-        while(node_stack.size() > 0){
-            const BVHNode* cur_node = node_stack.at(node_stack.size() - 1);
-            node_stack.erase(node_stack.end() - 1);
-            if(cur_node->child_1 && cur_node->child_2) {
-                const float dist1 = RayBoundingBoxIntersectionTest(ray, cur_node->child_1->bb);
-                const float dist2 = RayBoundingBoxIntersectionTest(ray, cur_node->child_2->bb);
-                if(dist1 == INFINITY && dist2 == INFINITY) {
-                    continue;
-                }
-                else if(dist1 == INFINITY) {
-                    node_stack.push_back(cur_node->child_2);
-                }
-                else if(dist2 == INFINITY) {
-                    node_stack.push_back(cur_node->child_1);
-                }
-                else if(dist1 > dist2) {
-                    node_stack.push_back(cur_node->child_2);
-                    node_stack.push_back(cur_node->child_1);
-                }
-                else {
-                    node_stack.push_back(cur_node->child_1);
-                    node_stack.push_back(cur_node->child_2);
-                }
+    RAY_PACKET_STATS_ADD(triangle_tests, ray_mask, count);
+    for(uint32_t trig_idx = first; trig_idx < first + count; ++trig_idx) {
+        const BoundingVolumeHierarchy::TriangleBlock& block = bvh.triangle_blocks[trig_idx / BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE];
+        const uint32_t block_lane = trig_idx % BoundingVolumeHierarchy::TRIANGLE_BLOCK_SIZE;
+        TriangleSimd v0[3], e1[3], e2[3];
+        for(int axis = 0; axis < 3; ++axis) {
+            v0[axis] = TriangleSimd::Broadcast(block.v0[axis][block_lane]);
+            e1[axis] = TriangleSimd::Broadcast(block.e1[axis][block_lane]);
+            e2[axis] = TriangleSimd::Broadcast(block.e2[axis][block_lane]);
+        }
+        for(uint32_t chunk = 0; chunk < chunk_count; ++chunk) {
+            const uint32_t active_lanes = PacketChunkMask(ray_mask, chunk);
+            if(!active_lanes) {
+                continue;
             }
-            else {
-                for(uint32_t trig_idx : cur_node->triangle_idx) {
-                    const BoundingVolumeHierarchy::Triangle& trig = bvh.triangle_data.at(trig_idx);
-                    RayHitResult trig_hit_result = RayTriangleIntersection(ray, trig);
-                    if(trig_hit_result.hit && trig_hit_result.length < hit_result.length) {
-                        hit_result = trig_hit_result;
-                    }
-                }
-                if(hit_result.hit) {
-                    return hit_result;
-                }
+            const uint32_t first_ray = chunk * RAY_PACKET_LANES;
+            TriangleSimd dst, u, v;
+            uint32_t mask = RayTriangleIntersection(LoadPacketChunk(packet, chunk), v0, e1, e2, TriangleSimd::Load(max_dist + first_ray), dst, u, v) & active_lanes;
+            while(mask) {
+                const uint32_t lane = SimdFirstBit(mask);
+                mask &= mask - 1;
+                RayTriangleHit& hit = hits[first_ray + lane];
+                hit.length = dst[lane];
+                hit.u = u[lane];
+                hit.v = v[lane];
+                hit.trig_idx = trig_idx;
+                max_dist[first_ray + lane] = hit.length;
             }
         }
     }
-    return hit_result;
+}
+// closest hit for every ray of the packet, hits[i].length has to hold the max distance of ray i on input
+// misses keep their input length, just like the single ray RayBinaryBVHTest
+static void RayPacketBVHTest(const RayPacket& packet, const BoundingVolumeHierarchy& bvh, RayTriangleHit* hits) {
+    float max_dist[RAY_PACKET_SIZE];
+    for(uint32_t i = 0; i < RAY_PACKET_SIZE; ++i) {
+        // rays with a negative max distance (and lanes past count) never pass a box or triangle test
+        max_dist[i] = i < packet.count ? hits[i].length : -INFINITY;
+    }
+    RayPacketTraverse(packet, bvh.nodes, max_dist, [&](uint32_t first, uint32_t count, RayPacketMask ray_mask) {
+        RayPacketLeafIntersection(packet, bvh, first, count, ray_mask, max_dist, hits);
+    });
+}
+
+static constexpr uint32_t RENDER_TILE_SIZE = 16;
+static_assert(RENDER_TILE_SIZE % RAY_PACKET_DIM == 0, "tiles have to be made of whole packets");
+
+// splits the image into tiles and hands them to the thread pool, tiles are split further into packet sized blocks
+// func(start_x, start_y, end_x, end_y) is called exactly once per block, blocks never share pixels
+template<typename F>
+static void ForEachPacketTiled(uint32_t w, uint32_t h, const F& func) {
+    const uint32_t tiles_x = (w + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    const uint32_t tiles_y = (h + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    GetThreadPool().ParallelFor(tiles_x * tiles_y, [&](uint32_t tile_idx, uint32_t) {
+        const uint32_t start_x = (tile_idx % tiles_x) * RENDER_TILE_SIZE;
+        const uint32_t start_y = (tile_idx / tiles_x) * RENDER_TILE_SIZE;
+        const uint32_t end_x = glm::min(start_x + RENDER_TILE_SIZE, w);
+        const uint32_t end_y = glm::min(start_y + RENDER_TILE_SIZE, h);
+        for(uint32_t y = start_y; y < end_y; y += RAY_PACKET_DIM) {
+            for(uint32_t x = start_x; x < end_x; x += RAY_PACKET_DIM) {
+                func(x, y, glm::min(x + RAY_PACKET_DIM, end_x), glm::min(y + RAY_PACKET_DIM, end_y));
+            }
+        }
+    });
 }
 
 RayImage RayTraceMesh(const RayCamera& cam, const Mesh& mesh, const glm::mat4& inv_model_mat, uint32_t w, uint32_t h) {
@@ -279,7 +2388,8 @@ RayImage RayTraceMesh(const RayCamera& cam, const Mesh& mesh, const glm::mat4& i
             if(RayBoundingBoxIntersectionTest(ray, mesh.bb) == INFINITY) {
                 continue;
             }
-            float closest_hit = INFINITY;
+            RayTriangleHit closest_hit = EmptyTriangleHit(INFINITY);
+            uint32_t closest_idx[3] = {};
             for(uint32_t k = 0; k < mesh.triangle_count; ++k) {
                 uint32_t idx_1 = 3 * k + 0;
                 uint32_t idx_2 = 3 * k + 1;
@@ -290,17 +2400,24 @@ RayImage RayTraceMesh(const RayCamera& cam, const Mesh& mesh, const glm::mat4& i
                     idx_3 = mesh.inds[idx_3];
                 }
 
-                const Vertex& v1 = mesh.verts[idx_1];
-                const Vertex& v2 = mesh.verts[idx_2];
-                const Vertex& v3 = mesh.verts[idx_3];
-                RayHitResult hit_result = RayTriangleIntersection(ray, v1, v2, v3);
-
-                if(hit_result.hit && hit_result.length < closest_hit) {
-                    image.colors[j * w + i] = hit_result.col;
-                    closest_hit = hit_result.length;
+                const glm::vec3& p1 = mesh.verts[idx_1].pos;
+                const glm::vec3& p2 = mesh.verts[idx_2].pos;
+                const glm::vec3& p3 = mesh.verts[idx_3].pos;
+                float dst, u, v;
+                if(RayTriangleIntersection(ray, p1, p2 - p1, p3 - p1, closest_hit.length, dst, u, v)) {
+                    closest_hit.length = dst;
+                    closest_hit.u = u;
+                    closest_hit.v = v;
+                    closest_hit.trig_idx = k;
+                    closest_idx[0] = idx_1;
+                    closest_idx[1] = idx_2;
+                    closest_idx[2] = idx_3;
                 }
             }
-            if(closest_hit == INFINITY) {
+            if(closest_hit.Hit()) {
+                image.colors[j * w + i] = ResolveHit(ray, mesh.verts[closest_idx[0]], mesh.verts[closest_idx[1]], mesh.verts[closest_idx[2]], closest_hit).col;
+            }
+            else {
                 //image.colors[j * w + i] = {1.0f, 1.0f / (float)w * (float)i, 1.0f / (float)h * (float)j, 1.0f};
             }
         }
@@ -317,59 +2434,402 @@ RayImage RayTraceBVH(const RayCamera& cam, const BoundingVolumeHierarchy& bvh, c
 
     const float sx = 1.0f / (float)w;
     const float sy = 1.0f / (float)h;
-    for(uint32_t j = 0; j < h; ++j) {
-        const float py = sy * (h - 1 - j);
-        for(uint32_t i = 0; i < w; ++i) {
-            const float px = sx * (w - 1 - i);
-            const glm::vec3 point_local = cam.bottom_left_local + glm::vec3(cam.plane_width * px, cam.plane_height * py, 0.0f);
-            const glm::vec3 point = cam.pos + cam.right * point_local.x + cam.up * point_local.y + cam.forward * point_local.z;
+    ForEachPacketTiled(w, h, [&](uint32_t start_x, uint32_t start_y, uint32_t end_x, uint32_t end_y) {
+        RayPacket packet;
+        RayTriangleHit hits[RAY_PACKET_SIZE];
+        packet.count = 0;
+        for(uint32_t j = start_y; j < end_y; ++j) {
+            const float py = sy * (h - 1 - j);
+            for(uint32_t i = start_x; i < end_x; ++i) {
+                const float px = sx * (w - 1 - i);
+                const glm::vec3 point_local = cam.bottom_left_local + glm::vec3(cam.plane_width * px, cam.plane_height * py, 0.0f);
+                const glm::vec3 point = cam.pos + cam.right * point_local.x + cam.up * point_local.y + cam.forward * point_local.z;
 
+                Ray ray = {};
+                ray.dir = inv_model_mat * glm::vec4(glm::normalize(point - cam.pos), 0.0f);
+                ray.origin = inv_model_mat * glm::vec4(cam.pos, 1.0f);
+                SetPacketRay(packet, packet.count, ray);
+                hits[packet.count] = EmptyTriangleHit(INFINITY);
+                packet.count++;
+            }
+        }
+        FinishPacket(packet);
+        RayPacketBVHTest(packet, bvh, hits);
 
-            Ray ray = {};
-            ray.dir = inv_model_mat * glm::vec4(glm::normalize(point - cam.pos), 0.0f);
-            ray.origin = inv_model_mat * glm::vec4(cam.pos, 1.0f);
+        uint32_t ray_idx = 0;
+        for(uint32_t j = start_y; j < end_y; ++j) {
+            for(uint32_t i = start_x; i < end_x; ++i, ++ray_idx) {
+                if(hits[ray_idx].Hit()) {
+                    image.colors[j * w + i] = ResolveHit(GetPacketRay(packet, ray_idx), bvh, hits[ray_idx]).col;
+                }
+            }
+        }
+    });
+
+    image.num_rendered_frames = 1;
+    return image;
+}
+static float GetLuminance(const glm::vec4& col) {
+    return 0.2126f * col.r + 0.7152f * col.g + 0.0722f * col.b;
+}
+// Vose's alias method, every slot ends up with a chance to keep itself and one alias for the rest
+// weights (summing to total > 0) are used as scratch space
+static void BuildAliasTable(std::vector<double>& weights, double total, std::vector<AliasEntry>& table) {
+    const uint32_t count = weights.size();
+    table.resize(count);
+    std::vector<uint32_t> small;
+    std::vector<uint32_t> large;
+    for(uint32_t i = 0; i < count; ++i) {
+        weights[i] *= count / total;
+        if(weights[i] < 1.0) {
+            small.push_back(i);
+        }
+        else {
+            large.push_back(i);
+        }
+    }
+    while(!small.empty() && !large.empty()) {
+        const uint32_t s = small.back();
+        small.pop_back();
+        const uint32_t l = large.back();
+        table[s] = {(float)weights[s], l};
+        weights[l] -= 1.0 - weights[s];
+        if(weights[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // whatever is left is 1 up to rounding
+    for(uint32_t i : large) {
+        table[i] = {1.0f, i};
+    }
+    for(uint32_t i : small) {
+        table[i] = {1.0f, i};
+    }
+}
+// u.x picks the slot, u.y decides between it and its alias
+static uint32_t SampleAliasTable(const std::vector<AliasEntry>& table, const glm::vec2& u) {
+    const uint32_t idx = glm::min((uint32_t)(u.x * (float)table.size()), (uint32_t)table.size() - 1);
+    if(u.y >= table[idx].probability) {
+        return table[idx].alias;
+    }
+    return idx;
+}
+// collects the world space triangles of every emissive object so lights can be sampled directly
+static void BuildEmitters(RayScene& scene) {
+    scene.emitter_triangles.clear();
+    scene.emitter_table.clear();
+    scene.emitter_area_pdf.assign(scene.objects.size(), 0.0f);
+    std::vector<double> weights;
+    std::vector<double> object_luminance(scene.objects.size(), 0.0);
+    double total = 0.0;
+    for(uint32_t i = 0; i < scene.objects.size(); ++i) {
+        const RayObject& obj = scene.objects[i];
+        const double luminance = GetLuminance(obj.material.emission_col * obj.material.emission_strength);
+        if(!obj.bvh || !(luminance > 0.0) || !std::isfinite(luminance)) {
+            continue;
+        }
+        // mirroring transforms flip the winding, the hit side has to flip with it
+        const glm::vec3 c0 = obj.mat[0];
+        const glm::vec3 c1 = obj.mat[1];
+        const glm::vec3 c2 = obj.mat[2];
+        const float winding = glm::dot(glm::cross(c0, c1), c2) < 0.0f ? -1.0f : 1.0f;
+        // spatial splits may reference a triangle more than once, it must only be sampled once
+        std::set<std::array<uint32_t, 3>> seen;
+        for(const BoundingVolumeHierarchy::Triangle& trig : obj.bvh->triangles) {
+            if(!seen.insert({trig.idx_1, trig.idx_2, trig.idx_3}).second) {
+                continue;
+            }
+            RayScene::EmitterTriangle emitter;
+            emitter.p0 = obj.mat * glm::vec4(obj.bvh->vertices[trig.idx_1].pos, 1.0f);
+            emitter.e1 = glm::vec3(obj.mat * glm::vec4(obj.bvh->vertices[trig.idx_2].pos, 1.0f)) - emitter.p0;
+            emitter.e2 = glm::vec3(obj.mat * glm::vec4(obj.bvh->vertices[trig.idx_3].pos, 1.0f)) - emitter.p0;
+            const glm::vec3 n = glm::cross(emitter.e1, emitter.e2) * winding;
+            const float double_area = glm::length(n);
+            if(!(double_area > 0.0f)) {
+                continue;
+            }
+            emitter.normal = n / double_area;
+            emitter.object_idx = i;
+            scene.emitter_triangles.push_back(emitter);
+            weights.push_back(0.5 * double_area * luminance);
+            total += weights.back();
+        }
+        object_luminance[i] = luminance;
+    }
+    if(!(total > 0.0)) {
+        scene.emitter_triangles.clear();
+        return;
+    }
+    // a triangle is picked with area * L / total and then a point on it with 1 / area
+    for(uint32_t i = 0; i < scene.objects.size(); ++i) {
+        scene.emitter_area_pdf[i] = (float)(object_luminance[i] / total);
+    }
+    BuildAliasTable(weights, total, scene.emitter_table);
+}
+void RayScene::BuildTopLevel() {
+    std::vector<BVHBuildPrimitive> prims;
+    prims.reserve(this->objects.size());
+    for(uint32_t i = 0; i < this->objects.size(); ++i) {
+        const RayObject& obj = this->objects[i];
+        if(!obj.bvh || obj.bvh->nodes.empty()) {
+            continue;
+        }
+        BVHBuildPrimitive prim;
+        prim.bb = TransformBoundingBox(obj.bvh->nodes[0].bb, obj.mat);
+        prim.center = (prim.bb.min + prim.bb.max) * 0.5f;
+        prim.idx = i;
+        prims.push_back(prim);
+    }
+    BVHBuildSettings settings;
+    settings.mode = BVHBuildSettings::SAH_BINNED;
+    settings.max_leaf_size = 4;
+    BuildNodes(this->top_level_nodes, prims, settings);
+    this->instance_ids.clear();
+    for(const BVHBuildPrimitive& prim : prims) {
+        this->instance_ids.push_back(prim.idx);
+    }
+    this->top_level_object_count = this->objects.size();
+    BuildEmitters(*this);
+}
 
-            RayHitResult hit_result = RayBoundingVolumeHierarchyTest(ray, bvh);
-            if(hit_result.hit) {
-                image.colors[j * w + i] = hit_result.col;
+// calls func(obj) for every object whose world space bounds the ray enters before max_dist
+// func may shrink max_dist and returns true to stop the traversal early
+template<typename F>
+static void RaySceneTraverse(const Ray& ray, const RayScene& scene, float& max_dist, const F& func) {
+    if(scene.top_level_object_count != scene.objects.size()) {
+        // no (or an outdated) top level BVH, so just test everything
+        for(const RayObject& obj : scene.objects) {
+            if(func(obj)) {
+                return;
             }
-            else {
-                //image.colors[j * w + i] = {1.0f, 1.0f / (float)w * (float)i, 1.0f / (float)h * (float)j, 1.0f};
+        }
+        return;
+    }
+    if(scene.top_level_nodes.empty()) {
+        return;
+    }
+    const glm::vec3 inv_dir = 1.0f / ray.dir;
+    struct StackEntry {
+        uint32_t node_idx;
+        float dist;
+    };
+    StackEntry node_stack[BoundingVolumeHierarchy::MAX_STACK_SIZE];
+    uint32_t stack_size = 0;
+    RAY_STATS_ADD(box_tests, 1);
+    const float root_dist = RayBoundingBoxIntersectionTest(ray.origin, inv_dir, scene.top_level_nodes[0].bb, max_dist);
+    if(root_dist == INFINITY) {
+        return;
+    }
+    node_stack[stack_size++] = {0, root_dist};
+    while(stack_size > 0) {
+        const StackEntry entry = node_stack[--stack_size];
+        if(entry.dist > max_dist) {
+            continue;
+        }
+        const BVHNode& cur_node = scene.top_level_nodes[entry.node_idx];
+        if(cur_node.triangle_count == 0) {
+            RAY_STATS_ADD(node_visits, 1);
+            RAY_STATS_ADD(box_tests, 2);
+            uint32_t child_1 = entry.node_idx + 1;
+            uint32_t child_2 = cur_node.offset;
+            float dist1 = RayBoundingBoxIntersectionTest(ray.origin, inv_dir, scene.top_level_nodes[child_1].bb, max_dist);
+            float dist2 = RayBoundingBoxIntersectionTest(ray.origin, inv_dir, scene.top_level_nodes[child_2].bb, max_dist);
+            if(dist2 < dist1) {
+                std::swap(child_1, child_2);
+                std::swap(dist1, dist2);
+            }
+            // push the far child first so the near one is popped next
+            if(dist2 != INFINITY) {
+                node_stack[stack_size++] = {child_2, dist2};
+            }
+            if(dist1 != INFINITY) {
+                node_stack[stack_size++] = {child_1, dist1};
+            }
+        }
+        else {
+            for(uint32_t i = cur_node.offset; i < cur_node.offset + cur_node.triangle_count; ++i) {
+                if(func(scene.objects[scene.instance_ids[i]])) {
+                    return;
+                }
             }
         }
     }
+}
 
-    image.num_rendered_frames = 1;
-    return image;
+static RayHitResult ResolveSceneHit(const Ray& ray, const RayObject* hit_obj, const RayTriangleHit& hit) {
+    if(!hit_obj) {
+        RayHitResult cur_hit_result = {};
+        cur_hit_result.hit = false;
+        cur_hit_result.length = INFINITY;
+        cur_hit_result.material = nullptr;
+        return cur_hit_result;
+    }
+    Ray hit_ray;
+    hit_ray.dir = hit_obj->inv_model_mat * glm::vec4(ray.dir, 0.0f);
+    hit_ray.origin = hit_obj->inv_model_mat * glm::vec4(ray.origin, 1.0f);
+    RayHitResult cur_hit_result = ResolveHit(hit_ray, *hit_obj->bvh, hit);
+    cur_hit_result.material = &hit_obj->material;
+    cur_hit_result.object = hit_obj;
+    cur_hit_result.pos = ray.origin + ray.dir * cur_hit_result.length;
+    cur_hit_result.normal = glm::normalize(hit_obj->mat * glm::vec4(cur_hit_result.normal, 0.0f));
+    return cur_hit_result;
 }
 static RayHitResult RaySceneCollisionTest(const Ray& ray, const RayScene& scene) {
-    RayHitResult cur_hit_result;
-    cur_hit_result.hit = false;
-    cur_hit_result.length = INFINITY;
-    cur_hit_result.material = nullptr;
-    Ray hit_ray;
-    for(const RayObject& obj : scene.objects) {
+    RAY_STATS_ADD(rays, 1);
+    RayTriangleHit closest_hit = EmptyTriangleHit(INFINITY);
+    const RayObject* hit_obj = nullptr;
+    RaySceneTraverse(ray, scene, closest_hit.length, [&](const RayObject& obj) {
         Ray cur_ray;
         cur_ray.dir = obj.inv_model_mat * glm::vec4(ray.dir, 0.0f);
         cur_ray.origin = obj.inv_model_mat * glm::vec4(ray.origin, 1.0f);
-        RayHitResult hit_result = RayBoundingVolumeHierarchyTest(cur_ray, *obj.bvh);
-        if(hit_result.hit && hit_result.length < cur_hit_result.length) {
-            cur_hit_result = hit_result;
-            cur_hit_result.material = &obj.material;
-            cur_hit_result.pos = ray.origin + ray.dir * cur_hit_result.length;
-            cur_hit_result.normal = glm::normalize(obj.mat * glm::vec4(hit_result.normal, 0.0f));
-            hit_ray = cur_ray;
+        // the ray parameter is the same in object and world space, so the closest hit culls every object
+        const RayTriangleHit hit = RayBoundingVolumeHierarchyTest(cur_ray, *obj.bvh, closest_hit.length);
+        if(hit.Hit()) {
+            closest_hit = hit;
+            hit_obj = &obj;
         }
+        return false;
+    });
+    return ResolveSceneHit(ray, hit_obj, closest_hit);
+}
+// packet version of RaySceneCollisionTest, the packet shares the top level traversal
+// and is moved into object space as a whole for every object it reaches
+static void RayPacketSceneTest(const RayPacket& packet, const RayScene& scene, RayHitResult* out_results) {
+    RAY_PACKET_STATS_ADD(rays, PacketAllRays(packet), 1);
+    float max_dist[RAY_PACKET_SIZE];
+    RayTriangleHit closest_hits[RAY_PACKET_SIZE];
+    const RayObject* hit_objs[RAY_PACKET_SIZE];
+    for(uint32_t i = 0; i < RAY_PACKET_SIZE; ++i) {
+        max_dist[i] = i < packet.count ? INFINITY : -INFINITY;
+        closest_hits[i] = EmptyTriangleHit(INFINITY);
+        hit_objs[i] = nullptr;
     }
-    return cur_hit_result;
+    RayPacket obj_packet;
+    RayTriangleHit obj_hits[RAY_PACKET_SIZE];
+    const auto test_object = [&](const RayObject& obj, RayPacketMask ray_mask) {
+        obj_packet.count = packet.count;
+        for(uint32_t i = 0; i < PacketChunkCount(packet) * RAY_PACKET_LANES; ++i) {
+            const Ray ray = GetPacketRay(packet, i);
+            Ray cur_ray;
+            cur_ray.dir = obj.inv_model_mat * glm::vec4(ray.dir, 0.0f);
+            cur_ray.origin = obj.inv_model_mat * glm::vec4(ray.origin, 1.0f);
+            SetPacketRay(obj_packet, i, cur_ray);
+            // rays that missed the object bounds are switched off
+            obj_hits[i] = EmptyTriangleHit((ray_mask >> i) & 1 ? max_dist[i] : -INFINITY);
+        }
+        RayPacketBVHTest(obj_packet, *obj.bvh, obj_hits);
+        for(uint32_t i = 0; i < packet.count; ++i) {
+            if(obj_hits[i].Hit()) {
+                closest_hits[i] = obj_hits[i];
+                hit_objs[i] = &obj;
+                max_dist[i] = obj_hits[i].length;
+            }
+        }
+    };
+    if(scene.top_level_object_count != scene.objects.size()) {
+        for(const RayObject& obj : scene.objects) {
+            test_object(obj, PacketAllRays(packet));
+        }
+    }
+    else {
+        RayPacketTraverse(packet, scene.top_level_nodes, max_dist, [&](uint32_t first, uint32_t count, RayPacketMask ray_mask) {
+            for(uint32_t i = first; i < first + count; ++i) {
+                test_object(scene.objects[scene.instance_ids[i]], ray_mask);
+            }
+        });
+    }
+    for(uint32_t i = 0; i < packet.count; ++i) {
+        out_results[i] = ResolveSceneHit(GetPacketRay(packet, i), hit_objs[i], closest_hits[i]);
+    }
+}
+static bool RaySceneOccluded(const Ray& ray, const RayScene& scene, float max_dist) {
+    RAY_STATS_ADD(rays, 1);
+    bool occluded = false;
+    RaySceneTraverse(ray, scene, max_dist, [&](const RayObject& obj) {
+        Ray cur_ray;
+        cur_ray.dir = obj.inv_model_mat * glm::vec4(ray.dir, 0.0f);
+        cur_ray.origin = obj.inv_model_mat * glm::vec4(ray.origin, 1.0f);
+        occluded = RayBoundingVolumeHierarchyOccluded(cur_ray, *obj.bvh, max_dist);
+        return occluded;
+    });
+    return occluded;
+}
+// texel of an equirectangular map that dir falls into, phi = atan2(z, x) runs right to left over the columns
+static uint32_t GetEnvironmentTexel(uint32_t width, uint32_t height, const glm::vec3& dir) {
+    float u = atan2f(dir.z, dir.x) / (2.0f * (float)M_PI);
+    u -= floorf(u);
+    const float theta = acosf(glm::clamp(dir.y, -1.0f, 1.0f));
+    const uint32_t x = glm::min((uint32_t)(u * (float)width), width - 1);
+    const uint32_t y = glm::min((uint32_t)(theta / (float)M_PI * (float)height), height - 1);
+    return y * width + (width - 1 - x);
 }
 static glm::vec4 GetEnvironmentLight(const Texture2D& hdr_map, const Ray& ray) {
     const glm::vec4* data = (const glm::vec4*)hdr_map.data;
-    const float phi = atan2f(ray.dir.z, ray.dir.x);
-    const float theta = acosf(ray.dir.y);
-    const uint32_t x = (uint32_t)(((phi ) / (2.0f * M_PI)) * hdr_map.width) % hdr_map.width;
-    const uint32_t y = (uint32_t)((theta / M_PI) * hdr_map.height) % hdr_map.height;
-    return data[y * hdr_map.width + (hdr_map.width - 1 - x)];
+    return data[GetEnvironmentTexel(hdr_map.width, hdr_map.height, ray.dir)];
+}
+void EnvironmentMapSampler::Build(const Texture2D* hdr_map) {
+    this->hdr_map = hdr_map;
+    this->table.clear();
+    this->texel_probability.clear();
+    if(!hdr_map || !hdr_map->data || hdr_map->type != Texture2D::DataType::Float || hdr_map->num_channels != 4) {
+        return;
+    }
+    const uint32_t w = hdr_map->width;
+    const uint32_t h = hdr_map->height;
+    const uint32_t count = w * h;
+    const glm::vec4* data = (const glm::vec4*)hdr_map->data;
+
+    // rows near the poles cover less solid angle, sin(theta) keeps them from being oversampled
+    std::vector<double> scaled(count);
+    double total = 0.0;
+    for(uint32_t y = 0; y < h; ++y) {
+        const double sin_theta = sin(M_PI * (y + 0.5) / h);
+        for(uint32_t x = 0; x < w; ++x) {
+            const double weight = glm::max(GetLuminance(data[y * w + x]), 0.0f) * sin_theta;
+            scaled[y * w + x] = std::isfinite(weight) ? weight : 0.0;
+            total += scaled[y * w + x];
+        }
+    }
+    if(!(total > 0.0)) {
+        return;
+    }
+    this->texel_probability.resize(count);
+    for(uint32_t i = 0; i < count; ++i) {
+        this->texel_probability[i] = (float)(scaled[i] / total);
+    }
+    BuildAliasTable(scaled, total, this->table);
+}
+// the sampler to use for scene, null if there is none that matches its hdr map
+static const EnvironmentMapSampler* GetEnvironmentSampler(const RayScene& scene) {
+    if(!scene.hdr_map || !scene.hdr_sampler || scene.hdr_sampler->IsEmpty() || scene.hdr_sampler->hdr_map != scene.hdr_map) {
+        return nullptr;
+    }
+    return scene.hdr_sampler;
+}
+// solid angle pdf of SampleEnvironment returning dir, the direction is uniform in (phi, theta) within the texel
+static float GetEnvironmentPdf(const EnvironmentMapSampler& sampler, const glm::vec3& dir) {
+    const float sin_theta = sqrtf(glm::max(1.0f - dir.y * dir.y, 0.0f));
+    if(sin_theta <= 0.0f) {
+        return 0.0f;
+    }
+    const uint32_t w = sampler.hdr_map->width;
+    const uint32_t h = sampler.hdr_map->height;
+    return sampler.texel_probability[GetEnvironmentTexel(w, h, dir)] * (float)(w * h) / (2.0f * (float)(M_PI * M_PI) * sin_theta);
+}
+static bool SampleEnvironment(const EnvironmentMapSampler& sampler, SampleSequence& sequence, glm::vec3& dir, float& pdf) {
+    const uint32_t w = sampler.hdr_map->width;
+    const uint32_t h = sampler.hdr_map->height;
+    const uint32_t texel = SampleAliasTable(sampler.table, sequence.Next2D());
+    const glm::vec2 u = sequence.Next2D();
+    const uint32_t x = w - 1 - texel % w;
+    const uint32_t y = texel / w;
+    const float phi = 2.0f * (float)M_PI * ((float)x + u.x) / (float)w;
+    const float theta = (float)M_PI * ((float)y + u.y) / (float)h;
+    const float sin_theta = sinf(theta);
+    dir = glm::vec3(sin_theta * cosf(phi), cosf(theta), sin_theta * sinf(phi));
+    pdf = GetEnvironmentPdf(sampler, dir);
+    return pdf > 0.0f;
 }
 
 // simple gradient
@@ -385,39 +2845,253 @@ static glm::vec4 GetEnvironmentLight(const Ray& ray) {
     }
     return glm::vec4(0.0f);
 }
-static glm::vec4 ShootRayInScene(const Ray& ray, const RayScene& scene, const glm::vec4& start_col, const glm::vec4& start_light_col, uint32_t max_bounces) {
+// the surface model of every RayMaterial: a lambertian lobe with the vertex color and a GGX lobe with
+// specular_col, mixed by specular_probability, the GGX roughness follows smoothness (1 is a mirror)
+// all directions point away from the surface, cos terms are taken against normal
+struct SurfaceBSDF {
+    glm::vec3 normal;
+    glm::vec3 tangent;
+    glm::vec3 bitangent;
+    glm::vec3 diffuse_col;
+    glm::vec3 specular_col;
+    float specular_probability;
+    float alpha;
+};
+// below this the GGX lobe gets too narrow for float precision, it already looks like a perfect mirror
+static constexpr float MIN_GGX_ALPHA = 1e-3f;
+static SurfaceBSDF CreateSurfaceBSDF(const RayHitResult& hit, const glm::vec3& wo) {
+    SurfaceBSDF bsdf;
+    bsdf.normal = glm::dot(hit.normal, wo) < 0.0f ? -hit.normal : hit.normal;
+    BuildOrthonormalBasis(bsdf.normal, bsdf.tangent, bsdf.bitangent);
+    bsdf.diffuse_col = hit.col;
+    bsdf.specular_col = hit.material->specular_col;
+    bsdf.specular_probability = glm::clamp(hit.material->specular_probability, 0.0f, 1.0f);
+    const float roughness = 1.0f - glm::clamp(hit.material->smoothness, 0.0f, 1.0f);
+    bsdf.alpha = glm::max(roughness * roughness, MIN_GGX_ALPHA);
+    return bsdf;
+}
+static float GGXDistribution(float n_dot_h, float alpha) {
+    const float a2 = alpha * alpha;
+    const float d = n_dot_h * n_dot_h * (a2 - 1.0f) + 1.0f;
+    return a2 / ((float)M_PI * d * d);
+}
+// smith masking of one direction
+static float GGXSmithG1(float n_dot_v, float alpha) {
+    const float a2 = alpha * alpha;
+    return 2.0f * n_dot_v / (n_dot_v + sqrtf(a2 + (1.0f - a2) * n_dot_v * n_dot_v));
+}
+// bsdf times cos(theta_i)
+static glm::vec3 EvaluateBSDF(const SurfaceBSDF& bsdf, const glm::vec3& wo, const glm::vec3& wi) {
+    const float n_dot_i = glm::dot(bsdf.normal, wi);
+    const float n_dot_o = glm::dot(bsdf.normal, wo);
+    if(n_dot_i <= 0.0f || n_dot_o <= 0.0f) {
+        return glm::vec3(0.0f);
+    }
+    glm::vec3 res = bsdf.diffuse_col * ((1.0f - bsdf.specular_probability) * n_dot_i / (float)M_PI);
+    if(bsdf.specular_probability > 0.0f) {
+        const glm::vec3 h = glm::normalize(wi + wo);
+        const float n_dot_h = glm::dot(bsdf.normal, h);
+        const float g = GGXSmithG1(n_dot_i, bsdf.alpha) * GGXSmithG1(n_dot_o, bsdf.alpha);
+        res += bsdf.specular_col * (bsdf.specular_probability * GGXDistribution(n_dot_h, bsdf.alpha) * g / (4.0f * n_dot_o));
+    }
+    return res;
+}
+// solid angle pdf of SampleBSDF returning wi
+static float GetBSDFPdf(const SurfaceBSDF& bsdf, const glm::vec3& wo, const glm::vec3& wi) {
+    const float n_dot_i = glm::dot(bsdf.normal, wi);
+    if(n_dot_i <= 0.0f || glm::dot(bsdf.normal, wo) <= 0.0f) {
+        return 0.0f;
+    }
+    float pdf = (1.0f - bsdf.specular_probability) * n_dot_i / (float)M_PI;
+    if(bsdf.specular_probability > 0.0f) {
+        const glm::vec3 h = glm::normalize(wi + wo);
+        const float n_dot_h = glm::dot(bsdf.normal, h);
+        pdf += bsdf.specular_probability * GGXDistribution(n_dot_h, bsdf.alpha) * n_dot_h / (4.0f * glm::dot(wo, h));
+    }
+    return pdf;
+}
+// picks one of the lobes and samples it, weight is EvaluateBSDF / GetBSDFPdf (the throughput factor of the bounce)
+// returns false if the sample ended up below the surface, which ends the path
+static bool SampleBSDF(const SurfaceBSDF& bsdf, const glm::vec3& wo, SampleSequence& sequence, glm::vec3& wi, glm::vec3& weight, float& pdf) {
+    const float u_lobe = sequence.Next1D();
+    const glm::vec2 u = sequence.Next2D();
+    if(u_lobe < bsdf.specular_probability) {
+        const glm::vec3 h_local = SquareToGGXNormal(u, bsdf.alpha);
+        const glm::vec3 h = bsdf.tangent * h_local.x + bsdf.bitangent * h_local.y + bsdf.normal * h_local.z;
+        wi = glm::reflect(-wo, h);
+    }
+    else {
+        const glm::vec3 local = SquareToCosineDirection(u);
+        wi = bsdf.tangent * local.x + bsdf.bitangent * local.y + bsdf.normal * local.z;
+    }
+    pdf = GetBSDFPdf(bsdf, wo, wi);
+    if(pdf <= 0.0f) {
+        return false;
+    }
+    weight = EvaluateBSDF(bsdf, wo, wi) / pdf;
+    return true;
+}
+
+// multiple importance sampling weight of a sample taken with pdf_a that could also have come from pdf_b
+static float PowerHeuristic(float pdf_a, float pdf_b) {
+    const float a2 = pdf_a * pdf_a;
+    const float b2 = pdf_b * pdf_b;
+    return a2 / (a2 + b2);
+}
+// light reaching pos from a direction picked by the environment sampler, times the bsdf
+// weighted against the bsdf picking the same direction, the other half of that is in ShootRayInScene
+static glm::vec3 SampleEnvironmentLight(const EnvironmentMapSampler& sampler, const RayScene& scene, const SurfaceBSDF& bsdf, const glm::vec3& pos, const glm::vec3& wo, SampleSequence& sequence) {
+    Ray shadow_ray;
+    float light_pdf;
+    if(!SampleEnvironment(sampler, sequence, shadow_ray.dir, light_pdf)) {
+        return glm::vec3(0.0f);
+    }
+    const glm::vec3 f = EvaluateBSDF(bsdf, wo, shadow_ray.dir);
+    if(f.r <= 0.0f && f.g <= 0.0f && f.b <= 0.0f) {
+        return glm::vec3(0.0f);
+    }
+    shadow_ray.origin = pos;
+    if(RaySceneOccluded(shadow_ray, scene, INFINITY)) {
+        return glm::vec3(0.0f);
+    }
+    const float mis = PowerHeuristic(light_pdf, GetBSDFPdf(bsdf, wo, shadow_ray.dir));
+    return glm::vec3(GetEnvironmentLight(*sampler.hdr_map, shadow_ray)) * f * (mis / light_pdf);
+}
+// emitter sampling needs the tables of the current objects, like the top level BVH
+static bool HasEmitters(const RayScene& scene) {
+    return !scene.emitter_table.empty() && scene.top_level_object_count == scene.objects.size() && scene.emitter_area_pdf.size() == scene.objects.size();
+}
+// solid angle pdf of SampleEmitterLight picking the point hit was found at from a ray of length hit.length along dir
+static float GetEmitterPdf(const RayScene& scene, const RayHitResult& hit, const glm::vec3& dir) {
+    const uint32_t object_idx = hit.object - scene.objects.data();
+    const float area_pdf = scene.emitter_area_pdf[object_idx];
+    if(area_pdf <= 0.0f) {
+        return 0.0f;
+    }
+    // the interpolated normal doesn't describe the area the point was picked on, the face normal does
+    const BoundingVolumeHierarchy& bvh = *hit.object->bvh;
+    const BoundingVolumeHierarchy::Triangle& trig = bvh.triangles[hit.triangle_idx];
+    const glm::vec3 p0 = hit.object->mat * glm::vec4(bvh.vertices[trig.idx_1].pos, 1.0f);
+    const glm::vec3 p1 = hit.object->mat * glm::vec4(bvh.vertices[trig.idx_2].pos, 1.0f);
+    const glm::vec3 p2 = hit.object->mat * glm::vec4(bvh.vertices[trig.idx_3].pos, 1.0f);
+    const glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+    const float n_len = glm::length(n);
+    const float cos_light = glm::abs(glm::dot(n, dir)) / n_len;
+    if(!(cos_light > 0.0f)) {
+        return 0.0f;
+    }
+    return area_pdf * hit.length * hit.length / cos_light;
+}
+// light reaching pos from a point picked on an emissive object, times the bsdf
+// weighted against the bsdf picking the same direction, the other half of that is in ShootRayInScene
+static glm::vec3 SampleEmitterLight(const RayScene& scene, const SurfaceBSDF& bsdf, const glm::vec3& pos, const glm::vec3& wo, SampleSequence& sequence) {
+    const RayScene::EmitterTriangle& emitter = scene.emitter_triangles[SampleAliasTable(scene.emitter_table, sequence.Next2D())];
+    // uniform point on the triangle
+    const glm::vec2 u = sequence.Next2D();
+    const float su = sqrtf(u.x);
+    const glm::vec3 point = emitter.p0 + emitter.e1 * (su * (1.0f - u.y)) + emitter.e2 * (su * u.y);
+
+    Ray shadow_ray;
+    shadow_ray.origin = pos;
+    shadow_ray.dir = point - pos;
+    const float dist2 = glm::dot(shadow_ray.dir, shadow_ray.dir);
+    if(!(dist2 > 0.0f)) {
+        return glm::vec3(0.0f);
+    }
+    const float dist = sqrtf(dist2);
+    shadow_ray.dir /= dist;
+    const float cos_light = -glm::dot(emitter.normal, shadow_ray.dir);
+    if(cos_light <= 0.0f) {
+        return glm::vec3(0.0f);
+    }
+    const glm::vec3 f = EvaluateBSDF(bsdf, wo, shadow_ray.dir);
+    if(f.r <= 0.0f && f.g <= 0.0f && f.b <= 0.0f) {
+        return glm::vec3(0.0f);
+    }
+    // stop just short of the light so it doesn't occlude itself
+    if(RaySceneOccluded(shadow_ray, scene, dist * (1.0f - 1e-4f))) {
+        return glm::vec3(0.0f);
+    }
+    const RayMaterial& material = scene.objects[emitter.object_idx].material;
+    const float light_pdf = scene.emitter_area_pdf[emitter.object_idx] * dist2 / cos_light;
+    const float mis = PowerHeuristic(light_pdf, GetBSDFPdf(bsdf, wo, shadow_ray.dir));
+    return glm::vec3(material.emission_col * material.emission_strength) * f * (mis / light_pdf);
+}
+
+// pairs of sequence dimensions every bounce owns, every decision has a fixed slot in them
+// so skipping one (no environment map, no emitters, last bounce) doesn't shift the ones after it
+static constexpr uint32_t BOUNCE_ENVIRONMENT_LIGHT_DIMENSION = 0; // texel and position in it
+static constexpr uint32_t BOUNCE_EMITTER_LIGHT_DIMENSION = 2; // triangle and point on it
+static constexpr uint32_t BOUNCE_BSDF_DIMENSION = 4; // lobe and direction
+static constexpr uint32_t BOUNCE_RUSSIAN_ROULETTE_DIMENSION = 6;
+static constexpr uint32_t BOUNCE_DIMENSIONS = 7;
+// path is the sequence of the pixel / texel and sample, at the first dimension the path may use, every
+// bounce starts at its own fixed dimension so the same decision always sees the same stratified pair
+// first_hit is the already traced hit of ray (camera rays are traced as packets), later bounces are traced one by one
+static glm::vec4 ShootRayInScene(const Ray& ray, const RayHitResult& first_hit, const RayScene& scene, const glm::vec4& start_col, const glm::vec4& start_light_col, uint32_t max_bounces, const SampleSequence& path) {
     glm::vec4 cur_col = start_col;
     glm::vec4 light_col = start_light_col;
 
+    const EnvironmentMapSampler* env_sampler = GetEnvironmentSampler(scene);
+    const bool has_emitters = HasEmitters(scene);
+    // pdf of the bsdf sample main_ray came from, 0 for the first ray which no light sample competed with
+    float bsdf_pdf = 0.0f;
     Ray main_ray = ray;
     for(uint32_t i = 0; i < max_bounces; ++i) {
-        RayHitResult cur_hit_result = RaySceneCollisionTest(main_ray, scene);
+        const RayHitResult cur_hit_result = i == 0 ? first_hit : RaySceneCollisionTest(main_ray, scene);
         if(cur_hit_result.hit) {
-            const float specular = cur_hit_result.material->specular_probability >= GetRandomFloat(0.0f, 1.0f) ? 1.0f : 0.0f;
-
-            main_ray.origin = cur_hit_result.pos;
+            RAY_STATS_ADD(bounces, 1);
+            const uint32_t bounce_dimension = path.dimension + i * BOUNCE_DIMENSIONS;
+            SampleSequence sequence(path.seed, path.sample_idx, bounce_dimension);
 
-            //glm::vec3 diffuse_dir = glm::normalize(cur_hit_result.normal + GetRandomNormalizedVector());
-            glm::vec3 diffuse_dir = GetRandomNormalizedVector();
-            if(glm::dot(diffuse_dir, cur_hit_result.normal) < 0.0f) {
-                diffuse_dir = -diffuse_dir;
+            glm::vec3 emitted = cur_hit_result.material->emission_col * cur_hit_result.material->emission_strength;
+            if(emitted.r > 0.0f || emitted.g > 0.0f || emitted.b > 0.0f) {
+                const float mis = has_emitters && bsdf_pdf > 0.0f ? PowerHeuristic(bsdf_pdf, GetEmitterPdf(scene, cur_hit_result, main_ray.dir)) : 1.0f;
+                light_col += glm::vec4(emitted * mis, 1.0f) * cur_col;
             }
-            const glm::vec3 specular_dir = glm::reflect(main_ray.dir, cur_hit_result.normal);
-            main_ray.dir = glm::normalize(glm::mix(diffuse_dir, specular_dir, cur_hit_result.material->smoothness * specular));
 
-            glm::vec3 emitted = cur_hit_result.material->emission_col * cur_hit_result.material->emission_strength;
-            light_col += glm::vec4(emitted, 1.0f) * cur_col;
-            cur_col *= glm::mix(cur_hit_result.col, cur_hit_result.material->specular_col, specular);
+            const glm::vec3 wo = -main_ray.dir;
+            const SurfaceBSDF bsdf = CreateSurfaceBSDF(cur_hit_result, wo);
+            // a light sample is one bounce longer, on the last bounce the bsdf ray it is weighted against is never traced
+            const bool sample_lights = i + 1 < max_bounces;
+            if(env_sampler && sample_lights) {
+                sequence.dimension = bounce_dimension + BOUNCE_ENVIRONMENT_LIGHT_DIMENSION;
+                light_col += glm::vec4(SampleEnvironmentLight(*env_sampler, scene, bsdf, cur_hit_result.pos, wo, sequence), 0.0f) * cur_col;
+            }
+            if(has_emitters && sample_lights) {
+                sequence.dimension = bounce_dimension + BOUNCE_EMITTER_LIGHT_DIMENSION;
+                light_col += glm::vec4(SampleEmitterLight(scene, bsdf, cur_hit_result.pos, wo, sequence), 0.0f) * cur_col;
+            }
+            glm::vec3 wi;
+            glm::vec3 weight;
+            sequence.dimension = bounce_dimension + BOUNCE_BSDF_DIMENSION;
+            if(!SampleBSDF(bsdf, wo, sequence, wi, weight, bsdf_pdf)) {
+                break;
+            }
+            main_ray.origin = cur_hit_result.pos;
+            main_ray.dir = wi;
+            cur_col *= glm::vec4(weight, 1.0f);
 
-            const float p = glm::max(cur_col.r, glm::max(cur_col.g, cur_col.b));
-            if(p <= 1e-10f) {
+            // nothing the path finds from here on can reach the camera any more
+            const float throughput = glm::max(cur_col.r, glm::max(cur_col.g, cur_col.b));
+            if(!(throughput > 0.0f)) {
                 break;
             }
-            cur_col *= 1.0f / p;
+            // russian roulette, paths continue with a chance that follows their throughput
+            // and the survivors are scaled up by the same amount so the average stays unbiased
+            if(i + 1 >= scene.russian_roulette_depth) {
+                const float p = glm::min(throughput, 1.0f);
+                sequence.dimension = bounce_dimension + BOUNCE_RUSSIAN_ROULETTE_DIMENSION;
+                if(sequence.Next1D() >= p) {
+                    break;
+                }
+                cur_col *= 1.0f / p;
+            }
         }
         else {
             if(scene.hdr_map) {
-                light_col += GetEnvironmentLight(*scene.hdr_map, main_ray) * cur_col;
+                const float mis = env_sampler && bsdf_pdf > 0.0f ? PowerHeuristic(bsdf_pdf, GetEnvironmentPdf(*env_sampler, main_ray.dir)) : 1.0f;
+                light_col += GetEnvironmentLight(*scene.hdr_map, main_ray) * cur_col * mis;
             }
             else {
                 light_col += GetEnvironmentLight(main_ray) * cur_col;
@@ -428,75 +3102,256 @@ static glm::vec4 ShootRayInScene(const Ray& ray, const RayScene& scene, const gl
     light_col.a = 1.0f;
     return light_col;
 }
-RayImage RayTraceScene(const RayCamera& cam, const RayScene& scene, uint32_t max_bounces, uint32_t sample_count, uint32_t w, uint32_t h) {
-    RayImage image(w, h);
-    for(size_t i = 0; i < image.width * image.height; ++i) {
-        image.colors[i] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
-    }
-    const float color_scale = 1.0f / (float)sample_count;
+static glm::vec4 ShootRayInScene(const Ray& ray, const RayScene& scene, const glm::vec4& start_col, const glm::vec4& start_light_col, uint32_t max_bounces, const SampleSequence& path) {
+    return ShootRayInScene(ray, RaySceneCollisionTest(ray, scene), scene, start_col, start_light_col, max_bounces, path);
+}
+
+// traces sample sample_idx of every pixel in the block and adds it to accum_col (one entry per pixel in block order)
+// the camera rays are traced as one packet, jitter(u) turns a point of the pixel's sample sequence into the subpixel offset in pixels
+// pixel_stats is null or laid out like accum_col, the work of every path is added to its pixel
+template<typename F>
+static void TraceCameraPacket(const RayCamera& cam, const RayScene& scene, uint32_t w, uint32_t h, uint32_t start_x, uint32_t start_y, uint32_t end_x, uint32_t end_y, uint32_t sample_idx, uint32_t max_bounces, const F& jitter, glm::vec4* accum_col, RayTraceStats* pixel_stats) {
     const glm::vec4 start_col = {1.0f, 1.0f, 1.0f, 1.0f};
     const glm::vec4 start_light_col = {0.0f, 0.0f, 0.0f, 1.0f};
-
     const float sx = 1.0f / (float)w;
     const float sy = 1.0f / (float)h;
     const glm::vec2 pixel_scale = glm::vec2(sx, sy);
-    for(uint32_t j = 0; j < h; ++j) {
+
+    RayPacket packet;
+    packet.count = 0;
+    for(uint32_t j = start_y; j < end_y; ++j) {
         const float py = sy * (h - 1 - j);
-        for(uint32_t i = 0; i < w; ++i) {
+        for(uint32_t i = start_x; i < end_x; ++i) {
             const float px = sx * (w - 1 - i);
-            glm::vec4 accum_col = {};
             const glm::vec3 point_local = cam.bottom_left_local + glm::vec3(cam.plane_width * px, cam.plane_height * py, 0.0f);
             const glm::vec3 point = cam.pos + cam.right * point_local.x + cam.up * point_local.y + cam.forward * point_local.z;
-            for(uint32_t k = 0; k < sample_count; ++k) {
-                glm::vec2 rand_vec = GetRandomPointInSquare() * pixel_scale;
-                const glm::vec3 offset_point = point + cam.right * rand_vec.x + cam.up * rand_vec.y;
+            SampleSequence sequence(RandomSeed(j * w + i), sample_idx);
+            glm::vec2 rand_vec = jitter(sequence.Next2D()) * pixel_scale;
+            const glm::vec3 offset_point = point + cam.right * rand_vec.x + cam.up * rand_vec.y;
 
-                Ray ray = {};
-                ray.dir = glm::normalize(offset_point - cam.pos);
-                ray.origin = cam.pos;
-                accum_col += ShootRayInScene(ray, scene, start_col, start_light_col, max_bounces);
-            }
-            image.colors[j * w + i] = accum_col * color_scale;
+            Ray ray = {};
+            ray.dir = glm::normalize(offset_point - cam.pos);
+            ray.origin = cam.pos;
+            SetPacketRay(packet, packet.count++, ray);
+        }
+    }
+    FinishPacket(packet);
+    RayHitResult first_hits[RAY_PACKET_SIZE];
+    if(max_bounces > 0) {
+        RayStatsScope stats_scope(nullptr, pixel_stats);
+        RayPacketSceneTest(packet, scene, first_hits);
+    }
+
+    uint32_t ray_idx = 0;
+    for(uint32_t j = start_y; j < end_y; ++j) {
+        for(uint32_t i = start_x; i < end_x; ++i, ++ray_idx) {
+            // the jitter used the first pair
+            const SampleSequence path(RandomSeed(j * w + i), sample_idx, 1);
+            RayStatsScope stats_scope(pixel_stats ? &pixel_stats[ray_idx] : nullptr);
+            accum_col[ray_idx] += ShootRayInScene(GetPacketRay(packet, ray_idx), first_hits[ray_idx], scene, start_col, start_light_col, max_bounces, path);
         }
     }
+}
+
+// clears stats for a frame of w x h pixels, returns the start time for EndFrameStats
+static std::chrono::steady_clock::time_point BeginFrameStats(RayTraceFrameStats* stats, uint32_t w, uint32_t h, uint32_t sample_count) {
+    if(stats) {
+        stats->total = {};
+        stats->pixels.assign((size_t)w * h, RayTraceStats{});
+        stats->width = w;
+        stats->height = h;
+        stats->sample_count = sample_count;
+    }
+    return std::chrono::steady_clock::now();
+}
+static void EndFrameStats(RayTraceFrameStats* stats, std::chrono::steady_clock::time_point start_time) {
+    if(!stats) {
+        return;
+    }
+    stats->trace_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+    for(const RayTraceStats& pixel : stats->pixels) {
+        stats->total += pixel;
+    }
+}
+// per packet stats for TraceCameraPacket, only allocated when they can actually be counted
+#if RAYTRACER_STATS
+#define DECLARE_TILE_STATS(name, frame_stats) RayTraceStats name##_storage[RAY_PACKET_SIZE]; RayTraceStats* name = (frame_stats) ? name##_storage : nullptr
+#else
+#define DECLARE_TILE_STATS(name, frame_stats) RayTraceStats* name = nullptr
+#endif
+
+RayImage RayTraceScene(const RayCamera& cam, const RayScene& scene, uint32_t max_bounces, uint32_t sample_count, uint32_t w, uint32_t h, RayTraceFrameStats* stats) {
+    RayImage image(w, h);
+    const float color_scale = 1.0f / (float)sample_count;
+    const auto start_time = BeginFrameStats(stats, w, h, sample_count);
+
+    ForEachPacketTiled(w, h, [&](uint32_t start_x, uint32_t start_y, uint32_t end_x, uint32_t end_y) {
+        glm::vec4 accum_col[RAY_PACKET_SIZE] = {};
+        DECLARE_TILE_STATS(pixel_stats, stats);
+        for(uint32_t k = 0; k < sample_count; ++k) {
+            TraceCameraPacket(cam, scene, w, h, start_x, start_y, end_x, end_y, k, max_bounces, [](const glm::vec2& u) { return u - 0.5f; }, accum_col, pixel_stats);
+        }
+        uint32_t ray_idx = 0;
+        for(uint32_t j = start_y; j < end_y; ++j) {
+            for(uint32_t i = start_x; i < end_x; ++i, ++ray_idx) {
+                image.colors[j * w + i] = accum_col[ray_idx] * color_scale;
+                if(pixel_stats) {
+                    stats->pixels[j * w + i] = pixel_stats[ray_idx];
+                }
+            }
+        }
+    });
     image.num_rendered_frames = sample_count;
+    EndFrameStats(stats, start_time);
     return image;
 }
-void RayTraceSceneAccumulate(RayImage& img, const RayCamera& cam, const RayScene& scene, uint32_t max_bounces, uint32_t sample_count) {
-    const float color_scale = 1.0f / (float)sample_count;
+// blocks need this many samples per pixel before their noise estimate is trusted, a few samples can all miss a small light
+static constexpr uint32_t ADAPTIVE_MIN_SAMPLES = 16;
+// keeps dark pixels, where even a large relative error is invisible, from asking for samples forever
+static constexpr double ADAPTIVE_LUMINANCE_OFFSET = 0.01;
+
+float RayPixelEstimate::GetRelativeError() const {
+    if(this->sample_count < 2) {
+        return 0.0f;
+    }
+    const double n = this->sample_count;
+    const double mean = this->luminance_sum / n;
+    const double variance = glm::max((this->luminance_sq_sum - mean * this->luminance_sum) / (n - 1.0), 0.0);
+    return (float)(sqrt(variance / n) / (fabs(mean) + ADAPTIVE_LUMINANCE_OFFSET));
+}
+static bool IsBlockConverged(const RayImage& img, uint32_t start_x, uint32_t start_y, uint32_t end_x, uint32_t end_y, float noise_threshold) {
+    for(uint32_t j = start_y; j < end_y; ++j) {
+        for(uint32_t i = start_x; i < end_x; ++i) {
+            const RayPixelEstimate& estimate = img.estimates[j * img.width + i];
+            if(estimate.sample_count < ADAPTIVE_MIN_SAMPLES || estimate.GetRelativeError() > noise_threshold) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+bool RayTraceSceneAccumulate(RayImage& img, const RayCamera& cam, const RayScene& scene, uint32_t max_bounces, uint32_t sample_count, RayTraceFrameStats* stats, float noise_threshold) {
     const uint32_t w = img.width;
     const uint32_t h = img.height;
+    const auto start_time = BeginFrameStats(stats, w, h, sample_count);
+    if(img.num_rendered_frames == 0 || img.estimates.size() != (size_t)w * h) {
+        img.estimates.assign((size_t)w * h, RayPixelEstimate{});
+    }
+    const bool adaptive = noise_threshold > 0.0f;
+    std::atomic<uint32_t> noisy_blocks = 0;
 
-    const float sx = 1.0f / (float)w;
-    const float sy = 1.0f / (float)h;
-    const glm::vec2 pixel_scale = glm::vec2(sx, sy);
-    img.frame_scale = 1.0f / (img.num_rendered_frames + 1);
-    const glm::vec4 start_col = {1.0f, 1.0f, 1.0f, 1.0f};
-    const glm::vec4 start_light_col = {0.0f, 0.0f, 0.0f, 1.0f};
-    
-
-    for(uint32_t j = 0; j < h; ++j) {
-        const float py = sy * (h - 1 - j);
-        for(uint32_t i = 0; i < w; ++i) {
-            const float px = sx * (w - 1 - i);
-            glm::vec4 accum_col = {};
-            const glm::vec3 point_local = cam.bottom_left_local + glm::vec3(cam.plane_width * px, cam.plane_height * py, 0.0f);
-            const glm::vec3 point = cam.pos + cam.right * point_local.x + cam.up * point_local.y + cam.forward * point_local.z;
-            for(uint32_t k = 0; k < sample_count; ++k) {
-                glm::vec2 rand_vec = GetRandomPointInCircle() * pixel_scale;
-                const glm::vec3 offset_point = point + cam.right * rand_vec.x + cam.up * rand_vec.y;
-
-                Ray ray = {};
-                ray.dir = glm::normalize(offset_point - cam.pos);
-                ray.origin = cam.pos;
-                accum_col += ShootRayInScene(ray, scene, start_col, start_light_col, max_bounces);
+    ForEachPacketTiled(w, h, [&](uint32_t start_x, uint32_t start_y, uint32_t end_x, uint32_t end_y) {
+        if(adaptive && IsBlockConverged(img, start_x, start_y, end_x, end_y, noise_threshold)) {
+            return;
+        }
+        // the pixels of a block always get their samples together, so they all have the same count
+        const uint32_t first_sample = img.estimates[start_y * w + start_x].sample_count;
+        const uint32_t pixel_count = (end_x - start_x) * (end_y - start_y);
+        glm::vec4 accum_col[RAY_PACKET_SIZE] = {};
+        double luminance_sum[RAY_PACKET_SIZE] = {};
+        double luminance_sq_sum[RAY_PACKET_SIZE] = {};
+        DECLARE_TILE_STATS(pixel_stats, stats);
+        for(uint32_t k = 0; k < sample_count; ++k) {
+            // every sample on its own for the variance
+            glm::vec4 sample_col[RAY_PACKET_SIZE] = {};
+            TraceCameraPacket(cam, scene, w, h, start_x, start_y, end_x, end_y, first_sample + k, max_bounces, [](const glm::vec2& u) { return SquareToDisk(u); }, sample_col, pixel_stats);
+            for(uint32_t ray_idx = 0; ray_idx < pixel_count; ++ray_idx) {
+                const double luminance = GetLuminance(sample_col[ray_idx]);
+                accum_col[ray_idx] += sample_col[ray_idx];
+                luminance_sum[ray_idx] += luminance;
+                luminance_sq_sum[ray_idx] += luminance * luminance;
+            }
+        }
+        uint32_t ray_idx = 0;
+        for(uint32_t j = start_y; j < end_y; ++j) {
+            for(uint32_t i = start_x; i < end_x; ++i, ++ray_idx) {
+                RayPixelEstimate& estimate = img.estimates[j * w + i];
+                const float prev_count = (float)estimate.sample_count;
+                img.colors[j * w + i] = (img.colors[j * w + i] * prev_count + accum_col[ray_idx]) / (prev_count + (float)sample_count);
+                estimate.sample_count += sample_count;
+                estimate.luminance_sum += luminance_sum[ray_idx];
+                estimate.luminance_sq_sum += luminance_sq_sum[ray_idx];
+                if(pixel_stats) {
+                    stats->pixels[j * w + i] = pixel_stats[ray_idx];
+                }
             }
-            accum_col *= color_scale;
+        }
+        if(adaptive && !IsBlockConverged(img, start_x, start_y, end_x, end_y, noise_threshold)) {
+            noisy_blocks.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+    img.num_rendered_frames += 1;
+    EndFrameStats(stats, start_time);
+    return adaptive && noisy_blocks.load() == 0;
+}
 
-            img.colors[j * w + i] = (img.colors[j * w + i] * (1.0f - img.frame_scale) + accum_col * img.frame_scale);
+uint64_t RayTraceStats::Get(Counter counter) const {
+    switch(counter) {
+    case RAYS: return this->rays;
+    case NODE_VISITS: return this->node_visits;
+    case BOX_TESTS: return this->box_tests;
+    case TRIANGLE_TESTS: return this->triangle_tests;
+    case BOUNCES: return this->bounces;
+    default: return 0;
+    }
+}
+const char* RayTraceStats::GetName(Counter counter) {
+    switch(counter) {
+    case RAYS: return "rays";
+    case NODE_VISITS: return "node_visits";
+    case BOX_TESTS: return "box_tests";
+    case TRIANGLE_TESTS: return "triangle_tests";
+    case BOUNCES: return "bounces";
+    default: return "unknown";
+    }
+}
+RayTraceStats& RayTraceStats::operator+=(const RayTraceStats& o) {
+    this->rays += o.rays;
+    this->node_visits += o.node_visits;
+    this->box_tests += o.box_tests;
+    this->triangle_tests += o.triangle_tests;
+    this->bounces += o.bounces;
+    return *this;
+}
+RayImage RayTraceFrameStats::CreateHeatmap(RayTraceStats::Counter counter, float max_value) const {
+    RayImage image(this->width, this->height);
+    if(max_value <= 0.0f) {
+        for(const RayTraceStats& pixel : this->pixels) {
+            max_value = glm::max(max_value, (float)pixel.Get(counter));
         }
     }
-    img.num_rendered_frames += 1;
+    const float scale = max_value > 0.0f ? 1.0f / max_value : 0.0f;
+    // blue, cyan, green, yellow, red
+    const glm::vec3 ramp[] = {{0.0f, 0.0f, 1.0f}, {0.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {1.0f, 1.0f, 0.0f}, {1.0f, 0.0f, 0.0f}};
+    const uint32_t last = ARRSIZE(ramp) - 1;
+    for(size_t i = 0; i < this->pixels.size(); ++i) {
+        const float t = glm::clamp((float)this->pixels[i].Get(counter) * scale, 0.0f, 1.0f) * last;
+        const uint32_t idx = glm::min((uint32_t)t, last - 1);
+        image.colors[i] = glm::vec4(glm::mix(ramp[idx], ramp[idx + 1], t - idx), 1.0f);
+    }
+    image.num_rendered_frames = 1;
+    return image;
+}
+std::string RayTraceFrameStats::ToJson() const {
+    nlohmann::json report;
+    report["enabled"] = RAYTRACER_STATS != 0;
+    report["width"] = this->width;
+    report["height"] = this->height;
+    report["sample_count"] = this->sample_count;
+    report["trace_ms"] = this->trace_ms;
+    const double rays = (double)glm::max(this->total.rays, (uint64_t)1);
+    for(uint32_t i = 0; i < RayTraceStats::COUNTER_COUNT; ++i) {
+        const RayTraceStats::Counter counter = (RayTraceStats::Counter)i;
+        const char* name = RayTraceStats::GetName(counter);
+        uint64_t pixel_max = 0;
+        for(const RayTraceStats& pixel : this->pixels) {
+            pixel_max = glm::max(pixel_max, pixel.Get(counter));
+        }
+        report["total"][name] = this->total.Get(counter);
+        report["per_ray"][name] = (double)this->total.Get(counter) / rays;
+        report["pixel_max"][name] = pixel_max;
+    }
+    return report.dump(2);
 }
 
 
@@ -516,9 +3371,15 @@ void RayTraceMapper(LitObject& lit, const RayScene& scene, uint32_t max_bounces,
 
     RayImage accum_image(lit.lightmap.width, lit.lightmap.height);
 
-    for(const auto& trig : obj.bvh->triangle_data) {
-        const glm::vec2 vmin = glm::min(glm::min(trig.v1.uv, trig.v2.uv), trig.v3.uv);
-        const glm::vec2 vmax = glm::max(glm::max(trig.v1.uv, trig.v2.uv), trig.v3.uv);
+    const uint32_t first_sample = lit.lightmap.num_rendered_frames;
+    for(uint32_t trig_idx = 0; trig_idx < obj.bvh->GetTriangleCount(); ++trig_idx) {
+        const BoundingVolumeHierarchy::Triangle& trig_ids = obj.bvh->triangles[trig_idx];
+        const Vertex& v1 = obj.bvh->vertices[trig_ids.idx_1];
+        const Vertex& v2 = obj.bvh->vertices[trig_ids.idx_2];
+        const Vertex& v3 = obj.bvh->vertices[trig_ids.idx_3];
+        const uint64_t trig_seed = RandomSeed(lit.scene_idx, trig_idx);
+        const glm::vec2 vmin = glm::min(glm::min(v1.uv, v2.uv), v3.uv);
+        const glm::vec2 vmax = glm::max(glm::max(v1.uv, v2.uv), v3.uv);
 
         const glm::ivec2 num_steps = (vmax - vmin) * glm::vec2((float)w, (float)h) + glm::vec2(2, 2);
         const glm::vec2 vsize = (vmax - vmin);
@@ -526,12 +3387,15 @@ void RayTraceMapper(LitObject& lit, const RayScene& scene, uint32_t max_bounces,
         const float step_x = 1.0f / (float)(num_steps.x - 1) * vsize.x;
         const float step_y = 1.0f / (float)(num_steps.y - 1) * vsize.y;
         
-        const float inv_signed_area = 1.0f / CalcSignedTriangleArea(trig.v1.uv, trig.v2.uv, trig.v3.uv);
+        const float inv_signed_area = 1.0f / CalcSignedTriangleArea(v1.uv, v2.uv, v3.uv);
         for(int y = -1; y <= num_steps.y + 1; ++y) {
             for(int x = -1; x <= num_steps.x + 1; ++x) {
                 for(uint32_t k = 0; k < sample_count; ++k) {
-                    const float sx = step_x * ((float)(x - 1) + GetRandomFloat(-0.5f, 0.5f));
-                    const float sy = step_y * ((float)(y - 1) + GetRandomFloat(-0.5f, 0.5f));
+                    // one sequence per sample point of the triangle, it jitters the point and then picks the directions
+                    SampleSequence sequence(RandomSeed(trig_seed, x + 1, y + 1), first_sample + k);
+                    const glm::vec2 jitter = sequence.Next2D() - 0.5f;
+                    const float sx = step_x * ((float)(x - 1) + jitter.x);
+                    const float sy = step_y * ((float)(y - 1) + jitter.y);
 
                     const glm::vec2 cur_uv = vmin + glm::vec2(sx, sy);
                     glm::ivec2 cur_px = cur_uv * glm::vec2((float)w, (float)h);
@@ -539,24 +3403,24 @@ void RayTraceMapper(LitObject& lit, const RayScene& scene, uint32_t max_bounces,
                         continue;
                     }
                     
-                    const float abp = CalcSignedTriangleArea(trig.v1.uv, trig.v2.uv, cur_uv) * inv_signed_area;
-                    const float bcp = CalcSignedTriangleArea(trig.v2.uv, trig.v3.uv, cur_uv) * inv_signed_area;
-                    const float cap = CalcSignedTriangleArea(trig.v3.uv, trig.v1.uv, cur_uv) * inv_signed_area;
+                    const float abp = CalcSignedTriangleArea(v1.uv, v2.uv, cur_uv) * inv_signed_area;
+                    const float bcp = CalcSignedTriangleArea(v2.uv, v3.uv, cur_uv) * inv_signed_area;
+                    const float cap = CalcSignedTriangleArea(v3.uv, v1.uv, cur_uv) * inv_signed_area;
                     const float epsilon = 4.0f * std::max(step_x, step_y);
                     if((abp >= -epsilon && bcp >= -epsilon && cap >= -epsilon)) {
                         Ray ray;
 
-                        const glm::vec3 pos = (trig.v3.pos * abp + trig.v1.pos * bcp + trig.v2.pos * cap);
-                        const glm::vec3 nor = (trig.v3.nor * abp + trig.v1.nor * bcp + trig.v2.nor * cap);
+                        const glm::vec3 pos = (v3.pos * abp + v1.pos * bcp + v2.pos * cap);
+                        const glm::vec3 nor = (v3.nor * abp + v1.nor * bcp + v2.nor * cap);
 
                         ray.origin = obj.mat * glm::vec4(pos, 1.0f);
                         const glm::vec3 cur_nor = glm::normalize(obj.mat * glm::vec4(nor, 0.0f));
-                        glm::vec3 normal = GetRandomNormalizedVector();
-                        if(glm::dot(cur_nor, normal) < 0.0f) {
-                            normal = -normal;
-                        }
-                        ray.dir = normal;
-                        accum_image.colors[cur_px.y * w + cur_px.x] += ShootRayInScene(ray, scene, start_col, start_light_col, max_bounces);
+                        // cosine weighted, so the average of the paths is the diffuse irradiance
+                        glm::vec3 tangent, bitangent;
+                        BuildOrthonormalBasis(cur_nor, tangent, bitangent);
+                        const glm::vec3 local = SquareToCosineDirection(sequence.Next2D());
+                        ray.dir = tangent * local.x + bitangent * local.y + cur_nor * local.z;
+                        accum_image.colors[cur_px.y * w + cur_px.x] += ShootRayInScene(ray, scene, start_col, start_light_col, max_bounces, sequence);
                     }
                 }
             }
@@ -1,33 +1,207 @@
 #pragma once
 #include "util.h"
+#include "simd.h"
 #include <iostream>
+#include <string>
 
+// 1 makes the traversal count its work per ray (see RayTraceStats), 0 compiles the counting away
+#ifndef RAYTRACER_STATS
+#define RAYTRACER_STATS 0
+#endif
 
 
+
+// the nodes are stored depth first in one array, so the first child
+// of an interior node is always the node right after it
 struct BVHNode {
     BoundingBox bb;
-    // index of the triangles inside this node
-    std::vector<uint32_t> triangle_idx;
-    BVHNode* child_1 = nullptr;
-    BVHNode* child_2 = nullptr;
+    // interior node: index of the second child
+    // leaf: index of the first triangle in triangles/triangle_blocks
+    uint32_t offset;
+    // number of triangles in the leaf, 0 for interior nodes
+    uint32_t triangle_count;
+};
+static_assert(sizeof(BVHNode) == 32, "BVHNode should stay 32 bytes");
+
+// W children per node with their bounds in structure of arrays layout, so a ray
+// is tested against all of them at once, created by collapsing the binary tree
+template<uint32_t W>
+struct WideBVHNode {
+    static constexpr uint32_t WIDTH = W;
+    float bb_min[3][W];
+    float bb_max[3][W];
+    // interior child: index of the child node, leaf child: first triangle
+    uint32_t child[W];
+    // triangles in a leaf child, 0 for interior children
+    uint32_t triangle_count[W];
+    // only the first child_count slots are used
+    uint32_t child_count;
+};
+using BVH4Node = WideBVHNode<4>;
+using BVH8Node = WideBVHNode<8>;
+// WideBVHNode with the child bounds stored as Q (uint8_t or uint16_t) steps inside the node's own box
+// bounds are rounded outwards, so the decoded boxes may be a little larger but never miss anything
+template<uint32_t W, typename Q>
+struct QuantizedBVHNode {
+    static constexpr uint32_t WIDTH = W;
+    // child bound = origin + q * scale
+    float origin[3];
+    float scale[3];
+    Q q_min[3][W];
+    Q q_max[3][W];
+    uint32_t child[W];
+    uint32_t triangle_count[W];
+    uint32_t child_count;
+};
+using BVH4NodeQ8 = QuantizedBVHNode<4, uint8_t>;
+using BVH4NodeQ16 = QuantizedBVHNode<4, uint16_t>;
+using BVH8NodeQ8 = QuantizedBVHNode<8, uint8_t>;
+using BVH8NodeQ16 = QuantizedBVHNode<8, uint16_t>;
+
+struct BVHBuildSettings {
+    enum Mode {
+        // splits at the middle of the longest axis (old behaviour)
+        MIDPOINT_SPLIT,
+        // surface area heuristic evaluated over binned triangle centroids
+        SAH_BINNED,
+        // splits along radix sorted morton codes of the centroids, much faster
+        // to build but slower to trace, meant for geometry that changes every frame
+        LINEAR_MORTON,
+        // SAH_BINNED plus spatial splits (SBVH), a triangle crossing a split plane may be
+        // referenced from both sides, which helps a lot with long thin triangles
+        SAH_SPATIAL,
+    };
+    static constexpr uint32_t MAX_BIN_COUNT = 64;
+    // deepest tree the traversal stacks are sized for, larger max_depth values are clamped to it
+    static constexpr uint32_t MAX_DEPTH = 60;
+    Mode mode = SAH_BINNED;
+    uint32_t max_depth = MAX_DEPTH;
+    // nodes with this many triangles or less always become leaves
+    uint32_t min_leaf_size = 1;
+    // nodes with more triangles than this are split even if the SAH says otherwise,
+    // LINEAR_MORTON splits down to single triangles and merges subtrees up to this size back into leaves
+    uint32_t max_leaf_size = 16;
+    uint32_t bin_count = 16;
+    // cost of visiting one node relative to intersecting a single triangle
+    float traversal_cost = 1.0f;
+    float intersection_cost = 1.0f;
+    // 2 keeps the binary tree, 4 or 8 collapse it into a wide BVH after the build
+    uint32_t collapse_width = 2;
+    // 8 or 16 stores the wide nodes with quantized child bounds (a bit over half the size
+    // for 8 bits), 0 keeps them as floats, has no effect without a collapse_width of 4 or 8
+    uint32_t quantize_bits = 0;
+    // SAH_SPATIAL: how many extra triangle references spatial splits may add, relative to the triangle count
+    float spatial_split_budget = 0.5f;
+    // SAH_SPATIAL: spatial splits are only tried where the children of the best object split
+    // overlap by more than this fraction of the root surface area
+    float spatial_split_alpha = 1e-5f;
+};
+
+// structure and memory use of a built BoundingVolumeHierarchy, see BoundingVolumeHierarchy::Analyze
+struct BVHQualityReport {
+    // same as BoundingVolumeHierarchy::GetSAHCost
+    float sah_cost = 0.0f;
+    // summed overlap of the two children of every interior node, relative to the root
+    // volume is 0 for flat meshes (the root has no volume), area covers that case
+    float sibling_overlap_volume = 0.0f;
+    float sibling_overlap_area = 0.0f;
+    uint32_t interior_count = 0;
+    uint32_t leaf_count = 0;
+    uint32_t max_depth = 0;
+    float average_leaf_depth = 0.0f;
+    // leaf_depths[d] leaves at depth d (the root is depth 0)
+    std::vector<uint32_t> leaf_depths;
+    // leaf_sizes[n] leaves with n triangles
+    std::vector<uint32_t> leaf_sizes;
+    // triangles referenced by all leaves, more than the mesh has if spatial splits duplicated some
+    uint32_t triangle_references = 0;
+    size_t node_bytes = 0;
+    // all wide node arrays, float or quantized
+    size_t wide_node_bytes = 0;
+    // triangle_blocks and triangles
+    size_t triangle_bytes = 0;
+    size_t vertex_bytes = 0;
+    size_t total_bytes = 0;
+
+    std::string ToJson() const;
 };
 
 struct BoundingVolumeHierarchy {
+    // the leaves test one block of triangles at a time with simd
+    static constexpr uint32_t TRIANGLE_BLOCK_SIZE = SIMD_NATIVE_WIDTH;
+    // everything the intersection test needs for TRIANGLE_BLOCK_SIZE triangles
+    // in structure of arrays layout, indexed [axis][lane]
+    // triangle i lives in block i / TRIANGLE_BLOCK_SIZE, lane i % TRIANGLE_BLOCK_SIZE
+    struct TriangleBlock {
+        float v0[3][TRIANGLE_BLOCK_SIZE];
+        float e1[3][TRIANGLE_BLOCK_SIZE];
+        float e2[3][TRIANGLE_BLOCK_SIZE];
+    };
+    // indices into vertices, only needed for shading
     struct Triangle {
-        Vertex v1;
-        Vertex v2;
-        Vertex v3;
-        glm::vec3 center;
+        uint32_t idx_1;
+        uint32_t idx_2;
+        uint32_t idx_3;
     };
+    // the midpoint builder may go one level past max_depth, so the stack keeps some headroom
+    static constexpr uint32_t MAX_DEPTH = BVHBuildSettings::MAX_DEPTH;
+    static constexpr uint32_t MAX_STACK_SIZE = 64;
     BoundingVolumeHierarchy() {};
     BoundingVolumeHierarchy(const BoundingVolumeHierarchy&) = delete;
     BoundingVolumeHierarchy(BoundingVolumeHierarchy&&);
     BoundingVolumeHierarchy& operator=(BoundingVolumeHierarchy&&);
 
+    // legacy midpoint split limited to max_steps levels
     void CreateFromMesh(const Mesh* mesh, uint32_t max_steps);
+    void CreateFromMesh(const Mesh* mesh, const BVHBuildSettings& settings);
+    // builds wide_nodes_4 or wide_nodes_8 from nodes, the traversal prefers them once they exist
+    // any other width removes the wide nodes again, with quantize_bits 8 or 16 the quantized
+    // versions are built instead of the float ones, settings is updated to match
+    void CollapseToWide(uint32_t width, uint32_t quantize_bits = 0);
+    // moves the triangles to the vertex positions of mesh and recomputes every node bound in place
+    // mesh has to have the same topology as the one the BVH was built from (otherwise it gets rebuilt)
+    // returns the SAH cost relative to the freshly built tree, once that climbs well above 1
+    // (around 1.5) the tree no longer fits the geometry and a rebuild pays off
+    float Refit(const Mesh* mesh);
+    // surface area heuristic cost of the binary tree, normalized by the root area
+    float GetSAHCost() const;
+    // walks the binary tree once, cheap enough to call after every build
+    BVHQualityReport Analyze() const;
+    // binary cache so unchanged meshes skip the build, the file layout is versioned by CACHE_VERSION
+    // key identifies the mesh data and build settings, a file saved under another key won't load
+    static constexpr uint32_t CACHE_VERSION = 3;
+    static uint64_t ComputeCacheKey(const Mesh* mesh, const BVHBuildSettings& settings);
+    bool SaveToFile(const char* filename, uint64_t key) const;
+    // maps the file and copies the arrays straight out of it, returns false (and keeps the current tree)
+    // if the file is missing, from another version or SIMD width, saved under another key, or holds
+    // indices outside of its arrays
+    bool LoadFromFile(const char* filename, uint64_t key);
+    // loads the tree for mesh + settings from cache_dir if it was built before, otherwise builds and saves it
+    void CreateFromMeshCached(const Mesh* mesh, const BVHBuildSettings& settings, const char* cache_dir);
     void Destroy();
-    std::vector<Triangle> triangle_data;
-    BVHNode root_node;
+    uint32_t GetTriangleCount() const { return (uint32_t)this->triangles.size(); }
+
+    // triangle_blocks and triangles are ordered by leaf, every leaf references a contiguous range
+    std::vector<TriangleBlock> triangle_blocks;
+    std::vector<Triangle> triangles;
+    // copy of the mesh vertices
+    std::vector<Vertex> vertices;
+    // nodes[0] is the root
+    std::vector<BVHNode> nodes;
+    // optional collapsed versions of nodes, wide_nodes_x[0] is the root
+    std::vector<BVH4Node> wide_nodes_4;
+    std::vector<BVH8Node> wide_nodes_8;
+    // at most one of all the wide node arrays is filled
+    std::vector<BVH4NodeQ8> wide_nodes_4_q8;
+    std::vector<BVH4NodeQ16> wide_nodes_4_q16;
+    std::vector<BVH8NodeQ8> wide_nodes_8_q8;
+    std::vector<BVH8NodeQ16> wide_nodes_8_q16;
+    // what the tree was built with, Refit compares against build_sah_cost
+    // (for SAH_SPATIAL the cost of the tree with leaves fit to whole triangles, like Refit does)
+    BVHBuildSettings settings;
+    float build_sah_cost = 0.0f;
+    // triangles of the source mesh, spatial splits can make triangles hold more than that
+    uint32_t mesh_triangle_count = 0;
 };
 
 struct RayMaterial {
@@ -39,6 +213,16 @@ struct RayMaterial {
 };
 
 
+// what RayTraceSceneAccumulate knows about the samples of one pixel, the noise estimate is based on their luminance
+struct RayPixelEstimate {
+    uint32_t sample_count;
+    double luminance_sum;
+    double luminance_sq_sum;
+
+    // standard error of the pixel mean relative to its luminance, 0 until there are two samples
+    float GetRelativeError() const;
+};
+
 struct RayImage {
     RayImage(uint32_t w, uint32_t h) {
         this->colors = new glm::vec4[w * h];
@@ -58,6 +242,7 @@ struct RayImage {
         this->width = o.width;
         this->height = o.height;
         this->num_rendered_frames = o.num_rendered_frames;
+        this->estimates = std::move(o.estimates);
         o.colors = nullptr;
     }
     RayImage& operator=(RayImage&& o) {
@@ -66,6 +251,7 @@ struct RayImage {
         this->width = o.width;
         this->height = o.height;
         this->num_rendered_frames = o.num_rendered_frames;
+        this->estimates = std::move(o.estimates);
         o.colors = nullptr;
         return *this;
     }
@@ -188,6 +374,8 @@ struct RayImage {
     uint32_t height;
     uint32_t num_rendered_frames;
     float frame_scale;
+    // one per pixel like colors, filled by RayTraceSceneAccumulate and reset with num_rendered_frames
+    std::vector<RayPixelEstimate> estimates;
 };
 
 
@@ -197,14 +385,103 @@ struct RayObject {
     glm::mat4 inv_model_mat;
     RayMaterial material;
 };
+// work done for one or more rays, only counted with RAYTRACER_STATS, all zero otherwise
+struct RayTraceStats {
+    enum Counter {
+        RAYS,
+        NODE_VISITS,
+        BOX_TESTS,
+        TRIANGLE_TESTS,
+        BOUNCES,
+        COUNTER_COUNT,
+    };
+    // closest hit and occlusion queries, camera rays included
+    uint64_t rays = 0;
+    // BVH nodes (bottom and top level) whose children were tested
+    uint64_t node_visits = 0;
+    uint64_t box_tests = 0;
+    uint64_t triangle_tests = 0;
+    // surface hits that continued the path
+    uint64_t bounces = 0;
+
+    uint64_t Get(Counter counter) const;
+    static const char* GetName(Counter counter);
+    RayTraceStats& operator+=(const RayTraceStats& o);
+};
+// what one RayTraceScene / RayTraceSceneAccumulate call did, all samples of a pixel are summed up
+struct RayTraceFrameStats {
+    RayTraceStats total;
+    // row major like RayImage::colors
+    std::vector<RayTraceStats> pixels;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t sample_count = 0;
+    float trace_ms = 0.0f;
+
+    // counter per pixel on a blue to red ramp, scaled so max_value (the largest pixel if 0) is red
+    RayImage CreateHeatmap(RayTraceStats::Counter counter, float max_value = 0.0f) const;
+    // totals, per ray averages and per pixel maxima of every counter
+    std::string ToJson() const;
+};
+
 struct LitObject {
     RayImage lightmap;
     uint32_t scene_idx;
 };
 
+// one slot of an alias table (Vose), picking from a discrete distribution costs one random slot and one comparison
+struct AliasEntry {
+    // chance to keep the slot the entry belongs to, otherwise alias is taken
+    float probability;
+    uint32_t alias;
+};
+
+// importance sampling table for an equirectangular hdr map (the layout GetEnvironmentLight reads)
+// texels are picked in proportion to their luminance times the solid angle they cover
+struct EnvironmentMapSampler {
+    // call again whenever the map changes, a map without any light leaves the sampler empty
+    void Build(const Texture2D* hdr_map);
+    bool IsEmpty() const { return this->table.empty(); }
+
+    const Texture2D* hdr_map = nullptr;
+    // one entry per texel, row major like the map
+    std::vector<AliasEntry> table;
+    // probability of each texel being picked, needed for the pdf of directions the sampler didn't pick
+    std::vector<float> texel_probability;
+};
+
 struct RayScene {
+    // builds the top level BVH over the world space bounds of all objects
+    // call it again whenever objects are added, removed, moved or their BVH changes
+    // several objects may share the same BoundingVolumeHierarchy
+    void BuildTopLevel();
+
     const Texture2D* hdr_map;
+    // optional, built from hdr_map, lets every bounce sample the environment directly
+    const EnvironmentMapSampler* hdr_sampler = nullptr;
+    // bounces every path takes before russian roulette may end it early
+    uint32_t russian_roulette_depth = 3;
     std::vector<RayObject> objects;
+    // leaves reference ranges of instance_ids, which index into objects
+    std::vector<BVHNode> top_level_nodes;
+    std::vector<uint32_t> instance_ids;
+    // objects.size() at the time of the last BuildTopLevel, if they differ every object is tested
+    uint32_t top_level_object_count = 0;
+
+    // world space triangle of an object with emission, also built by BuildTopLevel
+    struct EmitterTriangle {
+        glm::vec3 p0;
+        glm::vec3 e1;
+        glm::vec3 e2;
+        // normalized, points to the side the triangle can be hit from (and emits to)
+        glm::vec3 normal;
+        uint32_t object_idx;
+    };
+    std::vector<EmitterTriangle> emitter_triangles;
+    // picks an emitter triangle in proportion to its area times its emitted luminance, empty without emitters
+    std::vector<AliasEntry> emitter_table;
+    // per object, the pdf (per unit area) of a light sample landing on a given point of it, 0 if it doesn't emit
+    std::vector<float> emitter_area_pdf;
 };
 
 
@@ -236,8 +513,12 @@ struct RayCamera {
 
 RayImage RayTraceMesh(const RayCamera& cam, const Mesh& mesh, const glm::mat4& inv_model_mat, uint32_t w, uint32_t h);
 RayImage RayTraceBVH(const RayCamera& cam, const BoundingVolumeHierarchy& bvh, const glm::mat4& inv_model_mat, uint32_t w, uint32_t h);
-RayImage RayTraceScene(const RayCamera& cam, const RayScene& scene, uint32_t max_bounces, uint32_t sample_count, uint32_t w, uint32_t h);
-void RayTraceSceneAccumulate(RayImage& img, const RayCamera& cam, const RayScene& scene, uint32_t max_bounces, uint32_t sample_count);
+// stats is filled in if it isn't null, the counters stay zero unless RAYTRACER_STATS is 1
+RayImage RayTraceScene(const RayCamera& cam, const RayScene& scene, uint32_t max_bounces, uint32_t sample_count, uint32_t w, uint32_t h, RayTraceFrameStats* stats = nullptr);
+// adds sample_count samples per pixel to img, with a noise_threshold above 0 blocks of pixels whose relative error
+// (see RayPixelEstimate) is below it everywhere stop getting samples once they have enough for a reliable estimate
+// returns true when no pixel needs more samples, so the image has converged
+bool RayTraceSceneAccumulate(RayImage& img, const RayCamera& cam, const RayScene& scene, uint32_t max_bounces, uint32_t sample_count, RayTraceFrameStats* stats = nullptr, float noise_threshold = 0.0f);
 
 void RayTraceMapper(LitObject& lit, const RayScene& scene, uint32_t max_bounces, uint32_t sample_count);
 
@@ -0,0 +1,115 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+// tiny float vector wrapper so the wide BVH and packet code can be written once
+// SimdFloat<4> maps to SSE, SimdFloat<8> to AVX when the compiler targets it,
+// every other case falls back to plain arrays which the compiler may still vectorize
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_HAS_SSE 1
+#include <immintrin.h>
+#endif
+#if defined(__AVX__)
+#define SIMD_HAS_AVX 1
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+// widest vector the target handles natively
+#ifdef SIMD_HAS_AVX
+#define SIMD_NATIVE_WIDTH 8
+#else
+#define SIMD_NATIVE_WIDTH 4
+#endif
+
+template<uint32_t W>
+struct SimdFloat {
+    float v[W];
+    static SimdFloat Load(const float* p) { SimdFloat r; for(uint32_t i = 0; i < W; ++i) r.v[i] = p[i]; return r; }
+    static SimdFloat Broadcast(float f) { SimdFloat r; for(uint32_t i = 0; i < W; ++i) r.v[i] = f; return r; }
+    // converts W unsigned 8 or 16 bit integers, used to decode quantized bounds
+    template<typename T>
+    static SimdFloat LoadUnsigned(const T* p) { SimdFloat r; for(uint32_t i = 0; i < W; ++i) r.v[i] = (float)p[i]; return r; }
+    void Store(float* p) const { for(uint32_t i = 0; i < W; ++i) p[i] = this->v[i]; }
+    friend SimdFloat operator+(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; for(uint32_t i = 0; i < W; ++i) r.v[i] = a.v[i] + b.v[i]; return r; }
+    friend SimdFloat operator-(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; for(uint32_t i = 0; i < W; ++i) r.v[i] = a.v[i] - b.v[i]; return r; }
+    friend SimdFloat operator*(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; for(uint32_t i = 0; i < W; ++i) r.v[i] = a.v[i] * b.v[i]; return r; }
+    friend SimdFloat operator/(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; for(uint32_t i = 0; i < W; ++i) r.v[i] = a.v[i] / b.v[i]; return r; }
+    friend SimdFloat Min(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; for(uint32_t i = 0; i < W; ++i) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return r; }
+    friend SimdFloat Max(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; for(uint32_t i = 0; i < W; ++i) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return r; }
+    // comparisons return a bit mask, bit i set if lane i passes
+    friend uint32_t operator<(const SimdFloat& a, const SimdFloat& b) { uint32_t m = 0; for(uint32_t i = 0; i < W; ++i) m |= (uint32_t)(a.v[i] < b.v[i]) << i; return m; }
+    friend uint32_t operator<=(const SimdFloat& a, const SimdFloat& b) { uint32_t m = 0; for(uint32_t i = 0; i < W; ++i) m |= (uint32_t)(a.v[i] <= b.v[i]) << i; return m; }
+    friend uint32_t operator>=(const SimdFloat& a, const SimdFloat& b) { return b <= a; }
+    float operator[](uint32_t i) const { return this->v[i]; }
+};
+
+#ifdef SIMD_HAS_SSE
+template<>
+struct SimdFloat<4> {
+    __m128 v;
+    static SimdFloat Load(const float* p) { SimdFloat r; r.v = _mm_loadu_ps(p); return r; }
+    static SimdFloat Broadcast(float f) { SimdFloat r; r.v = _mm_set1_ps(f); return r; }
+    static SimdFloat LoadUnsigned(const uint8_t* p) {
+        int bytes;
+        memcpy(&bytes, p, sizeof(bytes));
+        const __m128i zero = _mm_setzero_si128();
+        SimdFloat r;
+        r.v = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero));
+        return r;
+    }
+    static SimdFloat LoadUnsigned(const uint16_t* p) {
+        SimdFloat r;
+        r.v = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128()));
+        return r;
+    }
+    void Store(float* p) const { _mm_storeu_ps(p, this->v); }
+    friend SimdFloat operator+(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; r.v = _mm_add_ps(a.v, b.v); return r; }
+    friend SimdFloat operator-(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; r.v = _mm_sub_ps(a.v, b.v); return r; }
+    friend SimdFloat operator*(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; r.v = _mm_mul_ps(a.v, b.v); return r; }
+    friend SimdFloat operator/(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; r.v = _mm_div_ps(a.v, b.v); return r; }
+    friend SimdFloat Min(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; r.v = _mm_min_ps(a.v, b.v); return r; }
+    friend SimdFloat Max(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; r.v = _mm_max_ps(a.v, b.v); return r; }
+    friend uint32_t operator<(const SimdFloat& a, const SimdFloat& b) { return (uint32_t)_mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)); }
+    friend uint32_t operator<=(const SimdFloat& a, const SimdFloat& b) { return (uint32_t)_mm_movemask_ps(_mm_cmple_ps(a.v, b.v)); }
+    friend uint32_t operator>=(const SimdFloat& a, const SimdFloat& b) { return (uint32_t)_mm_movemask_ps(_mm_cmpge_ps(a.v, b.v)); }
+    float operator[](uint32_t i) const { alignas(16) float f[4]; _mm_store_ps(f, this->v); return f[i]; }
+};
+#endif
+
+#ifdef SIMD_HAS_AVX
+template<>
+struct SimdFloat<8> {
+    __m256 v;
+    static SimdFloat Load(const float* p) { SimdFloat r; r.v = _mm256_loadu_ps(p); return r; }
+    static SimdFloat Broadcast(float f) { SimdFloat r; r.v = _mm256_set1_ps(f); return r; }
+    // AVX has no 256 bit integer unpacks, so both halves go through SSE
+    template<typename T>
+    static SimdFloat LoadUnsigned(const T* p) { SimdFloat r; r.v = _mm256_insertf128_ps(_mm256_castps128_ps256(SimdFloat<4>::LoadUnsigned(p).v), SimdFloat<4>::LoadUnsigned(p + 4).v, 1); return r; }
+    void Store(float* p) const { _mm256_storeu_ps(p, this->v); }
+    friend SimdFloat operator+(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; r.v = _mm256_add_ps(a.v, b.v); return r; }
+    friend SimdFloat operator-(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; r.v = _mm256_sub_ps(a.v, b.v); return r; }
+    friend SimdFloat operator*(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; r.v = _mm256_mul_ps(a.v, b.v); return r; }
+    friend SimdFloat operator/(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; r.v = _mm256_div_ps(a.v, b.v); return r; }
+    friend SimdFloat Min(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; r.v = _mm256_min_ps(a.v, b.v); return r; }
+    friend SimdFloat Max(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; r.v = _mm256_max_ps(a.v, b.v); return r; }
+    friend uint32_t operator<(const SimdFloat& a, const SimdFloat& b) { return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+    friend uint32_t operator<=(const SimdFloat& a, const SimdFloat& b) { return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)); }
+    friend uint32_t operator>=(const SimdFloat& a, const SimdFloat& b) { return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)); }
+    float operator[](uint32_t i) const { alignas(32) float f[8]; _mm256_store_ps(f, this->v); return f[i]; }
+};
+#endif
+
+// index of the lowest set bit, mask must not be 0
+inline uint32_t SimdFirstBit(uint32_t mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return (uint32_t)idx;
+#else
+    return (uint32_t)__builtin_ctz(mask);
+#endif
+}
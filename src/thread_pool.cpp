@@ -0,0 +1,146 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+// thread_idx of the job this thread is running, nested ParallelFor calls keep using it
+static constexpr uint32_t NOT_IN_POOL_JOB = 0xFFFFFFFFu;
+static thread_local uint32_t pool_job_thread_idx = NOT_IN_POOL_JOB;
+
+static uint64_t PackRange(uint32_t begin, uint32_t end) {
+    return (uint64_t)begin | ((uint64_t)end << 32);
+}
+
+ThreadPool::ThreadPool(uint32_t num_workers) {
+    this->ranges = std::make_unique<WorkRange[]>(num_workers + 1);
+    for(uint32_t i = 0; i < num_workers + 1; ++i) {
+        this->ranges[i].range.store(0);
+    }
+    for(uint32_t i = 0; i < num_workers; ++i) {
+        this->threads.emplace_back(&ThreadPool::WorkerLoop, this, i + 1);
+    }
+}
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->quit = true;
+    }
+    this->start_cv.notify_all();
+    for(std::thread& t : this->threads) {
+        t.join();
+    }
+}
+
+void ThreadPool::ParallelFor(uint32_t count, const Job& func) {
+    if(count == 0) {
+        return;
+    }
+    if(pool_job_thread_idx != NOT_IN_POOL_JOB) {
+        for(uint32_t i = 0; i < count; ++i) {
+            func(i, pool_job_thread_idx);
+        }
+        return;
+    }
+    if(this->threads.empty() || count == 1) {
+        for(uint32_t i = 0; i < count; ++i) {
+            func(i, 0);
+        }
+        return;
+    }
+    std::lock_guard<std::mutex> submit_lock(this->submit_mutex);
+    const uint32_t participants = this->GetThreadCount();
+    for(uint32_t i = 0; i < participants; ++i) {
+        const uint32_t begin = (uint32_t)((uint64_t)count * i / participants);
+        const uint32_t end = (uint32_t)((uint64_t)count * (i + 1) / participants);
+        this->ranges[i].range.store(PackRange(begin, end));
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->job = &func;
+        this->active_workers = (uint32_t)this->threads.size();
+        this->generation += 1;
+    }
+    this->start_cv.notify_all();
+
+    this->RunWork(0);
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->done_cv.wait(lock, [this]() { return this->active_workers == 0; });
+    this->job = nullptr;
+}
+
+void ThreadPool::WorkerLoop(uint32_t thread_idx) {
+    uint64_t seen_generation = 0;
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->start_cv.wait(lock, [&]() { return this->quit || this->generation != seen_generation; });
+            if(this->quit) {
+                return;
+            }
+            seen_generation = this->generation;
+        }
+        this->RunWork(thread_idx);
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->active_workers -= 1;
+        }
+        this->done_cv.notify_one();
+    }
+}
+
+void ThreadPool::RunWork(uint32_t thread_idx) {
+    pool_job_thread_idx = thread_idx;
+    while(true) {
+        uint32_t idx;
+        if(this->PopIndex(thread_idx, idx)) {
+            (*this->job)(idx, thread_idx);
+        }
+        else if(!this->StealWork(thread_idx)) {
+            break;
+        }
+    }
+    pool_job_thread_idx = NOT_IN_POOL_JOB;
+}
+
+bool ThreadPool::PopIndex(uint32_t thread_idx, uint32_t& idx) {
+    std::atomic<uint64_t>& range = this->ranges[thread_idx].range;
+    uint64_t cur = range.load();
+    while(true) {
+        const uint32_t begin = (uint32_t)cur;
+        const uint32_t end = (uint32_t)(cur >> 32);
+        if(begin >= end) {
+            return false;
+        }
+        if(range.compare_exchange_weak(cur, PackRange(begin + 1, end))) {
+            idx = begin;
+            return true;
+        }
+    }
+}
+
+// takes the upper half of the first non empty range it finds
+bool ThreadPool::StealWork(uint32_t thread_idx) {
+    const uint32_t participants = this->GetThreadCount();
+    for(uint32_t i = 1; i < participants; ++i) {
+        std::atomic<uint64_t>& victim = this->ranges[(thread_idx + i) % participants].range;
+        uint64_t cur = victim.load();
+        while(true) {
+            const uint32_t begin = (uint32_t)cur;
+            const uint32_t end = (uint32_t)(cur >> 32);
+            if(begin >= end) {
+                break;
+            }
+            const uint32_t take = (end - begin + 1) / 2;
+            if(victim.compare_exchange_weak(cur, PackRange(begin, end - take))) {
+                // our own range is empty, so nobody else can be modifying it
+                this->ranges[thread_idx].range.store(PackRange(end - take, end));
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+ThreadPool& GetThreadPool() {
+    static ThreadPool pool(std::max(std::thread::hardware_concurrency(), 1u) - 1);
+    return pool;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// fixed set of worker threads that run index ranges in parallel
+// every participant starts with an even share of the range and steals
+// half of another participant's remaining work once its own share is done
+struct ThreadPool {
+    // func(idx, thread_idx), thread_idx is in [0, GetThreadCount()) and no two threads working on the
+    // same call share one, nested calls pass on the thread_idx of the job they were made from
+    using Job = std::function<void(uint32_t idx, uint32_t thread_idx)>;
+
+    ThreadPool(uint32_t num_workers);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // runs func for every idx in [0, count) and returns once all of them are done
+    // the calling thread takes part, nested calls from inside a job run serially on the calling thread
+    void ParallelFor(uint32_t count, const Job& func);
+    // workers + the calling thread
+    uint32_t GetThreadCount() const { return (uint32_t)this->threads.size() + 1; }
+
+private:
+    struct alignas(64) WorkRange {
+        // low 32 bits: next index, high 32 bits: end index
+        std::atomic<uint64_t> range;
+    };
+    void WorkerLoop(uint32_t thread_idx);
+    void RunWork(uint32_t thread_idx);
+    bool PopIndex(uint32_t thread_idx, uint32_t& idx);
+    bool StealWork(uint32_t thread_idx);
+
+    std::vector<std::thread> threads;
+    std::unique_ptr<WorkRange[]> ranges;
+    std::mutex submit_mutex;
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    const Job* job = nullptr;
+    uint64_t generation = 0;
+    uint32_t active_workers = 0;
+    bool quit = false;
+};
+
+// shared pool sized to the machine
+ThreadPool& GetThreadPool();
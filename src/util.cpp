@@ -9,6 +9,19 @@
 #define JSON_NOEXCEPTION
 #include "tiny_gltf.h"
 #include "xatlas.h"
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #undef min
 #undef max
 
@@ -131,29 +144,33 @@ void RenderTexture::End() const {
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-Mesh CreateMesh(const Vertex* verts, const uint32_t* inds, uint32_t vert_count, uint32_t ind_count) {
+Mesh CreateMesh(const Vertex* verts, const uint32_t* inds, uint32_t vert_count, uint32_t ind_count, bool upload_to_gpu) {
     Mesh mesh = {};
+    mesh.vao = INVALID_GL_HANDLE;
+    mesh.vbo = INVALID_GL_HANDLE;
     mesh.ibo = INVALID_GL_HANDLE;
     mesh.bb.max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
     mesh.bb.min = {FLT_MAX, FLT_MAX, FLT_MAX};
 
-    glCreateVertexArrays(1, &mesh.vao);
-    glBindVertexArray(mesh.vao);
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vert_count, verts, GL_STATIC_DRAW);
+    if(upload_to_gpu) {
+        glCreateVertexArrays(1, &mesh.vao);
+        glBindVertexArray(mesh.vao);
+        glGenBuffers(1, &mesh.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vert_count, verts, GL_STATIC_DRAW);
 
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, pos));
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, pos));
 
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, nor));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, nor));
 
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv));
 
-    glEnableVertexAttribArray(3);
-    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, col));
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, col));
+    }
 
     for(uint32_t i = 0; i < vert_count; ++i) {
         mesh.bb.min = glm::min(mesh.bb.min, verts[i].pos);
@@ -164,9 +181,11 @@ Mesh CreateMesh(const Vertex* verts, const uint32_t* inds, uint32_t vert_count,
     mesh.vertex_count = vert_count;
 
     if(inds) {
-        glGenBuffers(1, &mesh.ibo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * ind_count, inds, GL_STATIC_DRAW);
+        if(upload_to_gpu) {
+            glGenBuffers(1, &mesh.ibo);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * ind_count, inds, GL_STATIC_DRAW);
+        }
         mesh.inds = new uint32_t[ind_count];
         memcpy(mesh.inds, inds, sizeof(uint32_t) * ind_count);
         mesh.triangle_count = ind_count / 3;
@@ -174,10 +193,12 @@ Mesh CreateMesh(const Vertex* verts, const uint32_t* inds, uint32_t vert_count,
     else {
         mesh.triangle_count = mesh.vertex_count / 3;
     }
-    glBindVertexArray(0);
+    if(upload_to_gpu) {
+        glBindVertexArray(0);
+    }
     return mesh;
 }
-GLTFLoadData LoadGLTFLoadData(const char* filename) {
+GLTFLoadData LoadGLTFLoadData(const char* filename, bool upload_to_gpu) {
     GLTFLoadData loaded = {};
 
     tinygltf::TinyGLTF loader;
@@ -220,7 +241,7 @@ GLTFLoadData LoadGLTFLoadData(const char* filename) {
         loaded.materials.push_back(mat);
     }
     for(const auto& tex : model.images) {
-        if(tex.bits == 8 && tex.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE) {
+        if(upload_to_gpu && tex.bits == 8 && tex.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE) {
             loaded.textures.push_back(CreateTexture2D((const uint32_t*)tex.image.data(), tex.width, tex.height));
         }
     }
@@ -285,11 +306,11 @@ GLTFLoadData LoadGLTFLoadData(const char* filename) {
                     }
                 }
                 else {
-                    std::cout << "[warning] vertex attribute is not being parsed: " << attrib.first << std::endl;
+                    std::cerr << "[warning] vertex attribute is not being parsed: " << attrib.first << std::endl;
                 }
             }
 
-            loaded.meshes.push_back({CreateMesh(verts, inds, vtx_count, idx_count), static_cast<uint32_t>(prim.material)});
+            loaded.meshes.push_back({CreateMesh(verts, inds, vtx_count, idx_count, upload_to_gpu), static_cast<uint32_t>(prim.material)});
             delete[] verts;
             delete[] inds;
         }
@@ -480,6 +501,98 @@ void DestroyRenderTexture(RenderTexture* tex) {
 }
 
 
+MappedFile::~MappedFile() {
+    CloseMappedFile(this);
+}
+MappedFile::MappedFile(MappedFile&& o) {
+    this->data = o.data;
+    this->size = o.size;
+    o.data = nullptr;
+    o.size = 0;
+}
+MappedFile& MappedFile::operator=(MappedFile&& o) {
+    CloseMappedFile(this);
+    this->data = o.data;
+    this->size = o.size;
+    o.data = nullptr;
+    o.size = 0;
+    return *this;
+}
+MappedFile OpenMappedFile(const char* filename) {
+    MappedFile res;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE) {
+        return res;
+    }
+    LARGE_INTEGER file_size;
+    if(!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return res;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    // the view keeps the mapping and the file alive on its own
+    CloseHandle(file);
+    if(!mapping) {
+        return res;
+    }
+    res.data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if(res.data) {
+        res.size = (size_t)file_size.QuadPart;
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        return res;
+    }
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        return res;
+    }
+    void* data = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data != MAP_FAILED) {
+        res.data = data;
+        res.size = (size_t)file_stat.st_size;
+    }
+#endif
+    return res;
+}
+void CloseMappedFile(MappedFile* file) {
+    if(file->data) {
+#ifdef _WIN32
+        UnmapViewOfFile(file->data);
+#else
+        munmap((void*)file->data, file->size);
+#endif
+    }
+    file->data = nullptr;
+    file->size = 0;
+}
+size_t GetPeakMemoryUsage() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters = {};
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return (size_t)counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss;
+#else
+    // kilobytes everywhere else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+
 std::string ReadShaderSource(const std::string& file_path) {
     std::ifstream shaderFile(file_path);
     if (!shaderFile.is_open()) {
@@ -893,7 +1006,7 @@ static void RasterizeTriangle(uint8_t *dest, int destWidth, const int *t0, const
 }
 static void XAtlasDebugRender(const xatlas::Atlas* atlas) {
     if (atlas->width > 0 && atlas->height > 0) {
-        printf("Rasterizing result...\n");
+        fprintf(stderr, "Rasterizing result...\n");
         // Dump images.
         std::vector<uint8_t> outputTrisImage, outputChartsImage;
         const uint32_t imageDataSize = atlas->width * atlas->height * 3;
@@ -1006,8 +1119,9 @@ ISize GenerateUVs(std::vector<Vertex>& verts, const std::vector<uint32_t>& inds,
         }
     }
     
+    const ISize size = {atlas->width, atlas->height};
     xatlas::Destroy(atlas);
-    return {atlas->width, atlas->height};
+    return size;
 }
 static std::string EXECUTABLE_PATH;
 void SetExecutablePath(const char* path) {
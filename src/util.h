@@ -5,7 +5,6 @@
 #include <glm/ext/matrix_transform.hpp>
 #include <vector>
 #include "glad/glad.h"
-#include "GLFW/glfw3.h"
 #include "tiny_gltf.h"
 #include <corecrt_math_defines.h>
 #include "FastNoise.h"
@@ -69,6 +68,18 @@ struct BoundingBox {
     glm::vec3 max;
 };
 
+// read only view of a whole file, pages are loaded by the OS on first access
+struct MappedFile {
+    MappedFile() {}
+    MappedFile(MappedFile&& o);
+    ~MappedFile();
+    MappedFile& operator=(MappedFile&& o);
+    MappedFile(const MappedFile&) = delete;
+
+    const void* data = nullptr;
+    size_t size = 0;
+};
+
 struct SimpleMaterial {
     Texture2D* diffuse_texture;
 };
@@ -130,9 +141,11 @@ struct GLTFLoadData {
 };
 
 
-Mesh CreateMesh(const Vertex* verts, const uint32_t* inds, uint32_t vert_count, uint32_t ind_count);
+// without upload_to_gpu only the cpu side copies are made, which needs no GL context
+Mesh CreateMesh(const Vertex* verts, const uint32_t* inds, uint32_t vert_count, uint32_t ind_count, bool upload_to_gpu = true);
 void DestroyMesh(Mesh* mesh);
-GLTFLoadData LoadGLTFLoadData(const char* filename);
+// without upload_to_gpu the meshes stay cpu only and no textures are loaded
+GLTFLoadData LoadGLTFLoadData(const char* filename, bool upload_to_gpu = true);
 void DestroyGLTFLoadData(GLTFLoadData* load);
 
 Texture2D CreateTexture2D(const uint32_t* data, uint32_t width, uint32_t height);
@@ -158,6 +171,12 @@ void GenerateIcoSphere(std::vector<Vertex>& verts, std::vector<uint32_t>& inds,
 
 ISize GenerateUVs(std::vector<Vertex>& verts, const std::vector<uint32_t>& inds, uint32_t max_resolution);
 
+// data stays nullptr if the file can't be opened or is empty
+MappedFile OpenMappedFile(const char* filename);
+void CloseMappedFile(MappedFile* file);
+// largest resident set size of the process so far in bytes, 0 if the OS doesn't report it
+size_t GetPeakMemoryUsage();
+
 void SetExecutablePath(const char* path);
 std::string TranslateRelativePath(const std::string& path);
 